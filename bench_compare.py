@@ -0,0 +1,187 @@
+"""
+Cross-implementation benchmark (C file store, C++ SQLite+XOR, Python SQLite+Fernet)
+-----------------------------------------------------------------------------------
+Builds the C and C++ workload drivers, runs the same generated workload
+against all three storage layers in separate processes and prints one
+comparison table of throughput per phase and peak RSS per process.
+
+Workload (identical in every driver): bulk add N students, 5 full listings,
+N grade updates, N deletes, ids visited in the order (i * 7919) % N + 1.
+Each implementation runs with its own defaults: the C store rewrites its
+text file on every update/delete, the C++ and Python stores commit every
+write to a SQLite file.
+
+Usage:
+    python3 bench_compare.py [--rows N] [--repeat R] [--only c,cpp,py] [--json FILE]
+"""
+
+import argparse
+import json
+import os
+import shutil
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+from typing import Dict, List, Optional
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+PHASES = ["add", "list", "update", "delete"]
+
+
+def peak_rss_kb() -> Optional[int]:
+    """VmHWM of this process image (resets at exec, unlike ru_maxrss)."""
+    try:
+        with open("/proc/self/status") as f:
+            for line in f:
+                if line.startswith("VmHWM:"):
+                    return int(line.split()[1])
+    except OSError:
+        pass
+    return None
+
+
+def python_driver(n: int, db_path: str) -> int:
+    """Same workload as sdms_workload.c, against sdms.DatabaseManager."""
+    sys.path.insert(0, HERE)
+    import sdms
+
+    def report(phase: str, ops: int, t0: float):
+        print(json.dumps({"phase": phase, "ops": ops, "seconds": time.perf_counter() - t0}), flush=True)
+
+    grades = ["A+", "A", "B", "C", "D", "F"]
+    for p in (db_path, db_path + ".key"):
+        if os.path.exists(p):
+            os.remove(p)
+    db = sdms.DatabaseManager(db_path, key_path=db_path + ".key")
+
+    t0 = time.perf_counter()
+    for i in range(1, n + 1):
+        db.add_student(sdms.Student(i, f"Student {i}", 18 + i % 10, grades[i % 6]))
+    report("add", n, t0)
+
+    t0 = time.perf_counter()
+    listed = sum(len(db.list_students()) for _ in range(5))
+    report("list", listed, t0)
+
+    t0 = time.perf_counter()
+    for i in range(1, n + 1):
+        db.update_grade(i * 7919 % n + 1, "B")
+    report("update", n, t0)
+
+    t0 = time.perf_counter()
+    for i in range(1, n + 1):
+        db.delete_student(i * 7919 % n + 1)
+    report("delete", n, t0)
+    print(json.dumps({"note": "fernet" if sdms.CRYPTO_OK else "base64 fallback (no cryptography)"}), flush=True)
+    kb = peak_rss_kb()
+    if kb is not None:
+        print(json.dumps({"peak_rss_kb": kb}), flush=True)
+    return 0
+
+
+def build(build_dir: str) -> Dict[str, Optional[str]]:
+    """Compile the native drivers; a missing compiler or library skips that driver."""
+    targets = {
+        "c": (["gcc", "-O2", os.path.join(HERE, "sdms_workload.c"), "-o"], []),
+        "cpp": (["g++", "-O2", os.path.join(HERE, "sdms_workload.cpp"), "-o"], ["-lsqlite3", "-lpthread"]),
+    }
+    out: Dict[str, Optional[str]] = {}
+    for name, (cmd, libs) in targets.items():
+        exe = os.path.join(build_dir, "sdms_workload_" + name)
+        if shutil.which(cmd[0]) is None:
+            print(f"skip {name}: {cmd[0]} not found", file=sys.stderr)
+            out[name] = None
+            continue
+        r = subprocess.run(cmd + [exe] + libs, capture_output=True, text=True)
+        if r.returncode != 0:
+            print(f"skip {name}: build failed\n{r.stderr}", file=sys.stderr)
+            out[name] = None
+        else:
+            out[name] = exe
+    out["py"] = sys.executable
+    return out
+
+
+def run_once(impl: str, exe: str, n: int, work_dir: str) -> dict:
+    """Run one driver process; returns per-phase results and its peak RSS."""
+    data = os.path.join(work_dir, {"c": "students.txt", "cpp": "students.db", "py": "students_py.db"}[impl])
+    if impl == "py":
+        cmd = [exe, os.path.abspath(__file__), "--python-driver", str(n), data]
+    else:
+        cmd = [exe, str(n), data]
+    proc = subprocess.Popen(cmd, stdout=subprocess.PIPE, cwd=work_dir, text=True)
+    output = proc.stdout.read()
+    # Fallback when the driver cannot report VmHWM: wait4 gives this child's
+    # own rusage, though ru_maxrss also counts the forked launcher before exec.
+    _, status, usage = os.wait4(proc.pid, 0)
+    proc.returncode = os.waitstatus_to_exitcode(status)
+    if proc.returncode != 0:
+        raise RuntimeError(f"{impl} driver exited with {proc.returncode}")
+    result = {"phases": {}, "maxrss_kb": usage.ru_maxrss, "note": ""}
+    for line in output.splitlines():
+        rec = json.loads(line)
+        if "phase" in rec:
+            result["phases"][rec["phase"]] = rec
+        elif "note" in rec:
+            result["note"] = rec["note"]
+        elif "peak_rss_kb" in rec:
+            result["maxrss_kb"] = rec["peak_rss_kb"]
+    return result
+
+
+def summarize(runs: List[dict]) -> dict:
+    """Median throughput per phase and worst peak RSS over the repeats."""
+    out = {"ops_per_s": {}, "maxrss_kb": max(r["maxrss_kb"] for r in runs), "note": runs[0]["note"]}
+    for phase in PHASES:
+        rates = [r["phases"][phase]["ops"] / r["phases"][phase]["seconds"]
+                 for r in runs if phase in r["phases"] and r["phases"][phase]["seconds"] > 0]
+        out["ops_per_s"][phase] = statistics.median(rates) if rates else None
+    return out
+
+
+def print_report(n: int, repeat: int, summary: Dict[str, dict]):
+    names = {"c": "C (text file)", "cpp": "C++ (SQLite+XOR)", "py": "Python (SQLite+Fernet)"}
+    print(f"\nrows={n}, median of {repeat} run(s), ops/s (list: rows/s)")
+    header = f"{'implementation':<24}" + "".join(f"{p:>12}" for p in PHASES) + f"{'peak RSS MB':>14}"
+    print(header)
+    print("-" * len(header))
+    for impl, s in summary.items():
+        cells = "".join(f"{s['ops_per_s'][p]:>12.0f}" if s["ops_per_s"][p] else f"{'-':>12}" for p in PHASES)
+        print(f"{names[impl]:<24}{cells}{s['maxrss_kb'] / 1024:>14.1f}" + (f"  ({s['note']})" if s["note"] else ""))
+
+
+def main():
+    if len(sys.argv) == 4 and sys.argv[1] == "--python-driver":
+        sys.exit(python_driver(int(sys.argv[2]), sys.argv[3]))
+
+    ap = argparse.ArgumentParser(description="Compare the C, C++ and Python student stores")
+    ap.add_argument("--rows", type=int, default=2000)
+    ap.add_argument("--repeat", type=int, default=3)
+    ap.add_argument("--only", default="c,cpp,py", help="comma-separated subset of c,cpp,py")
+    ap.add_argument("--json", help="also write the summary to this file")
+    args = ap.parse_args()
+    if args.rows <= 0 or args.rows % 7919 == 0:
+        ap.error("--rows must be positive and not a multiple of 7919")
+
+    with tempfile.TemporaryDirectory(prefix="sdms_compare_") as tmp:
+        exes = build(tmp)
+        summary: Dict[str, dict] = {}
+        for impl in args.only.split(","):
+            if not exes.get(impl):
+                continue
+            runs = []
+            for r in range(args.repeat):
+                print(f"{impl} run {r + 1}/{args.repeat}", file=sys.stderr)
+                runs.append(run_once(impl, exes[impl], args.rows, tmp))
+            summary[impl] = summarize(runs)
+
+    print_report(args.rows, args.repeat, summary)
+    if args.json:
+        with open(args.json, "w") as f:
+            json.dump({"rows": args.rows, "repeat": args.repeat, "results": summary}, f, indent=2)
+
+
+if __name__ == "__main__":
+    main()
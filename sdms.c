@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 
 /*
  * Student Database Management System (C - Minimal, File-Based)
@@ -8,6 +9,9 @@
  * - Stores records in a plain text file "students.txt" (CSV-like format).
  * - Demonstrates Data Structures (struct), basic file I/O, and menu-driven UI.
  * - Operations: Add, List, Delete by ID.
+ * - The store_* functions are the storage layer; the menu below only does
+ *   prompting. Define SDMS_NO_MAIN to #include this file from a driver
+ *   (see sdms_workload.c).
  *
  * NOTE: This C version stays minimal on purpose (no SQLite/OOP/encryption)
  *       to keep it portable and easy to compile everywhere.
@@ -17,6 +21,10 @@
 #define NAME_LEN 64
 #define GRADE_LEN 8
 
+// store_rewrite results besides found (1) / not found (0).
+#define STORE_NO_FILE (-1)
+#define STORE_IO_ERROR (-2)
+
 typedef struct {
     int id;
     char name[NAME_LEN];
@@ -24,7 +32,80 @@ typedef struct {
     char grade[GRADE_LEN];
 } Student;
 
-// Append a student as a CSV line to the file.
+// --- Storage layer ---
+
+// Append a student as a CSV line. Returns 0 on success, -1 on I/O error.
+int store_add(const char *path, const Student *s) {
+    FILE *f = fopen(path, "a");
+    if (!f) return -1;
+    fprintf(f, "%d,%s,%d,%s\n", s->id, s->name, s->age, s->grade);
+    return fclose(f) == 0 ? 0 : -1;
+}
+
+// Call fn for every parseable record. Returns the number of records, or -1
+// if the file does not exist yet.
+int store_for_each(const char *path, void (*fn)(const Student *, void *), void *ctx) {
+    FILE *f = fopen(path, "r");
+    if (!f) return -1;
+    char line[256];
+    int n = 0;
+    while (fgets(line, sizeof(line), f)) {
+        Student s;
+        // parse CSV line: id,name,age,grade
+        if (sscanf(line, "%d,%63[^,],%d,%7s", &s.id, s.name, &s.age, s.grade) == 4) {
+            fn(&s, ctx);
+            ++n;
+        }
+    }
+    fclose(f);
+    return n;
+}
+
+// Rewrite the file through a temp file, dropping the record with id (when
+// new_grade is NULL) or replacing its grade. Returns 1 if the record was
+// found, 0 if not, STORE_NO_FILE if the data file does not exist yet and
+// STORE_IO_ERROR if it could not be read or rewritten (errno is set).
+static int store_rewrite(const char *path, int target_id, const char *new_grade) {
+    FILE *in = fopen(path, "r");
+    if (!in) return errno == ENOENT ? STORE_NO_FILE : STORE_IO_ERROR;
+    char tmp[512];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *out = fopen(tmp, "w");
+    if (!out) { fclose(in); return STORE_IO_ERROR; }
+
+    char line[256];
+    int found = 0;
+    while (fgets(line, sizeof(line), in)) {
+        Student s;
+        if (sscanf(line, "%d,", &s.id) == 1 && s.id == target_id) {
+            found = 1;
+            if (!new_grade) continue; // skip writing this line
+            if (sscanf(line, "%d,%63[^,],%d,%7s", &s.id, s.name, &s.age, s.grade) == 4) {
+                fprintf(out, "%d,%s,%d,%.7s\n", s.id, s.name, s.age, new_grade);
+                continue;
+            }
+        }
+        fputs(line, out);
+    }
+    int read_error = ferror(in);
+    fclose(in);
+    if (fclose(out) != 0 || read_error) { remove(tmp); return STORE_IO_ERROR; }
+    remove(path);
+    if (rename(tmp, path) != 0) return STORE_IO_ERROR;
+    return found;
+}
+
+int store_delete(const char *path, int id) {
+    return store_rewrite(path, id, NULL);
+}
+
+int store_update_grade(const char *path, int id, const char *grade) {
+    return store_rewrite(path, id, grade);
+}
+
+#ifndef SDMS_NO_MAIN
+
+// Read a student from stdin and append it to the file.
 void add_student() {
     Student s;
     printf("Enter ID: ");
@@ -36,31 +117,24 @@ void add_student() {
     printf("Enter Grade: ");
     scanf(" %7s", s.grade);
 
-    FILE *f = fopen(DATA_FILE, "a");
-    if (!f) { perror("Failed to open file"); return; }
-    fprintf(f, "%d,%s,%d,%s\n", s.id, s.name, s.age, s.grade);
-    fclose(f);
+    if (store_add(DATA_FILE, &s) != 0) { perror("Failed to open file"); return; }
     printf("Student added.\n");
 }
 
+static void print_student(const Student *s, void *ctx) {
+    (void)ctx;
+    printf("%-6d | %-20s | %-4d | %-6s\n", s->id, s->name, s->age, s->grade);
+}
+
 // Read all students from the file and print them.
 void list_students() {
     FILE *f = fopen(DATA_FILE, "r");
     if (!f) { printf("No data yet.\n"); return; }
+    fclose(f);
 
     printf("\n%-6s | %-20s | %-4s | %-6s\n", "ID", "Name", "Age", "Grade");
     printf("-----------------------------------------------------\n");
-    char line[256];
-    while (fgets(line, sizeof(line), f)) {
-        Student s;
-        // parse CSV line: id,name,age,grade
-        char name[NAME_LEN], grade[GRADE_LEN];
-        int id, age;
-        if (sscanf(line, "%d,%63[^,],%d,%7s", &id, name, &age, grade) == 4) {
-            printf("%-6d | %-20s | %-4d | %-6s\n", id, name, age, grade);
-        }
-    }
-    fclose(f);
+    store_for_each(DATA_FILE, print_student, NULL);
 }
 
 // Remove a student with matching ID by rewriting the file without that record.
@@ -69,26 +143,9 @@ void delete_student() {
     printf("Enter ID to delete: ");
     scanf("%d", &targetId);
 
-    FILE *in = fopen(DATA_FILE, "r");
-    if (!in) { printf("No data file found.\n"); return; }
-    FILE *out = fopen("students.tmp", "w");
-    if (!out) { perror("Temp file"); fclose(in); return; }
-
-    char line[256];
-    int removed = 0;
-    while (fgets(line, sizeof(line), in)) {
-        int id;
-        if (sscanf(line, "%d,", &id) == 1 && id == targetId) {
-            removed = 1; // skip writing this line
-            continue;
-        }
-        fputs(line, out);
-    }
-    fclose(in);
-    fclose(out);
-    remove(DATA_FILE);
-    rename("students.tmp", DATA_FILE);
-
+    int removed = store_delete(DATA_FILE, targetId);
+    if (removed == STORE_NO_FILE) { printf("No data file found.\n"); return; }
+    if (removed == STORE_IO_ERROR) { perror("Error: failed to rewrite " DATA_FILE); return; }
     if (removed) printf("Student with ID %d removed.\n", targetId);
     else printf("No student with ID %d found.\n", targetId);
 }
@@ -114,3 +171,5 @@ int main() {
     }
     return 0;
 }
+
+#endif // SDMS_NO_MAIN
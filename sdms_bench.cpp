@@ -0,0 +1,1496 @@
+/*
+ * Benchmarks for the C++ store (sdms.cpp)
+ * ---------------------------------------
+ * Each scenario builds its own database (":memory:" unless noted, so SQLite
+ * CPU cost is measured rather than fsync latency) and times one phase.
+ *
+ * Build:
+ *   g++ -O2 sdms_bench.cpp -o sdms_bench -lsqlite3 -lpthread
+ *
+ * Usage:
+ *   ./sdms_bench [--rows N] [--keys N,N...] [--snapshot-rows N]
+ *                [--filter SUBSTRING] [--perf] [--reps N]
+ *                [--save-baseline FILE] [--baseline FILE] [--alpha P] [--threshold PCT]
+ *
+ * --keys sets the key counts of the "index" scenario (default 1000000), e.g.
+ * --keys 1000000,10000000,100000000; 100M keys need ~10 GB for std::map.
+ *
+ * --snapshot-rows sets the row count of the columnar StudentSnapshot
+ * scenarios (numa, compress, substring, dedup) and of the sketch scenario's in-memory
+ * phase, default 2000000.
+ *
+ * --reps runs every scenario N times; the table shows the median run.
+ * --save-baseline writes each scenario's per-rep us/op to FILE (JSON);
+ * --baseline compares this run against such a file with a one-sided
+ * Mann-Whitney U test and exits 3 if any CRUD scenario (crud, history,
+ * scan) is slower with p < alpha (default 0.05) and by more than
+ * threshold percent of the baseline median (default 5). Use --reps >= 5
+ * on both sides; with fewer samples no difference can reach significance.
+ *
+ * --perf reads hardware counters (perf_event_open) around every measured
+ * phase and adds per-op columns. Counters the kernel refuses (no PMU in a
+ * VM, perf_event_paranoid, seccomp) are reported once on stderr and shown
+ * as "-"; the timings are unaffected.
+ *
+ * Built with -DSDMS_ALLOC_PROFILE, every phase also reports heap calls and
+ * bytes per op (all threads, SQLite included), followed by the cumulative
+ * split by DatabaseManager operation.
+ */
+#define SDMS_NO_MAIN
+#include "sdms.cpp"
+
+#include <sstream>
+#include <deque>
+#include <cmath>
+#include <iterator>
+#include <cerrno>
+#include <cstring>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <malloc.h>
+#include <numeric>
+#include <random>
+#include <shared_mutex>
+#include <unordered_map>
+
+// --- Hardware counters ---
+
+// One user-space counter per event, inherited by threads the scenario
+// spawns. Events are opened independently rather than as a group so a PMU
+// with too few slots multiplexes instead of failing; values are scaled by
+// time_enabled / time_running.
+class PerfCounters {
+public:
+    enum { Cycles, Instructions, LlcMisses, BranchMisses, Count };
+    struct Sample {
+        double v[Count];
+        bool ok[Count];
+    };
+
+    PerfCounters() {
+        static const unsigned long long configs[Count] = {
+            PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+            PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+        for (int i = 0; i < Count; ++i) {
+            perf_event_attr a;
+            std::memset(&a, 0, sizeof(a));
+            a.size = sizeof(a);
+            a.type = PERF_TYPE_HARDWARE;
+            a.config = configs[i];
+            a.disabled = 1;
+            a.inherit = 1;
+            a.exclude_kernel = 1;
+            a.exclude_hv = 1;
+            a.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            fds[i] = (int)syscall(SYS_perf_event_open, &a, 0, -1, -1, 0);
+            if (fds[i] < 0) {
+                std::cerr << "perf: " << name(i) << " unavailable (" << std::strerror(errno) << ")\n";
+            }
+        }
+    }
+    ~PerfCounters() {
+        for (int fd : fds) if (fd >= 0) close(fd);
+    }
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+
+    bool any() const {
+        for (int fd : fds) if (fd >= 0) return true;
+        return false;
+    }
+
+    void start() {
+        for (int fd : fds) {
+            if (fd < 0) continue;
+            ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+
+    Sample stop() {
+        Sample s;
+        for (int i = 0; i < Count; ++i) {
+            s.v[i] = 0;
+            s.ok[i] = false;
+            if (fds[i] < 0) continue;
+            ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+            unsigned long long buf[3]; // value, time_enabled, time_running
+            if (read(fds[i], buf, sizeof(buf)) != (ssize_t)sizeof(buf) || buf[2] == 0) continue;
+            s.v[i] = (double)buf[0] * ((double)buf[1] / (double)buf[2]);
+            s.ok[i] = true;
+        }
+        return s;
+    }
+
+    static const char* name(int i) {
+        static const char* names[Count] = {"cycles", "instructions", "llc-misses", "branch-misses"};
+        return names[i];
+    }
+
+private:
+    int fds[Count];
+};
+
+struct BenchResult {
+    std::string scenario;
+    long long ops;
+    double seconds;
+    std::string detail; // free-form extra column (percentiles, counts, ...)
+    bool hasCounters = false;
+    PerfCounters::Sample counters = {};
+    AllocStats allocs = {0, 0}; // only filled in SDMS_ALLOC_PROFILE builds
+    bool gated = false;         // counts towards the --baseline exit status
+
+    double usPerOp() const { return ops ? seconds * 1e6 / ops : 0; }
+};
+
+// All repetitions of one scenario.
+struct ScenarioRuns {
+    std::string scenario;
+    std::vector<const BenchResult*> runs;
+
+    std::vector<double> usPerOp() const {
+        std::vector<double> v;
+        for (const BenchResult* r : runs) v.push_back(r->usPerOp());
+        return v;
+    }
+    // The run with the median us/op, shown in the table.
+    const BenchResult& median() const {
+        std::vector<const BenchResult*> sorted(runs);
+        std::sort(sorted.begin(), sorted.end(),
+                  [](const BenchResult* a, const BenchResult* b) { return a->usPerOp() < b->usPerOp(); });
+        return *sorted[(sorted.size() - 1) / 2];
+    }
+};
+
+class Bench {
+private:
+    std::vector<BenchResult> results;
+    std::unique_ptr<PerfCounters> perf;
+public:
+    long long rows = 20000;
+    std::vector<long long> indexKeys = {1000000}; // --keys, for the index scenario
+    long long snapshotRows = 2000000;             // --snapshot-rows, for columnar scenarios
+    bool gated = false; // set by main while a CRUD scenario runs
+
+    void enablePerf() {
+        perf.reset(new PerfCounters());
+        if (!perf->any()) {
+            std::cerr << "perf: no hardware counters available, reporting timings only\n";
+            perf.reset();
+        }
+    }
+
+    // Time fn, which returns how many operations it performed.
+    template <class F>
+    void measure(const std::string& name, F fn) {
+        BenchResult r{name, 0, 0, ""};
+        r.gated = gated;
+        AllocStats a0 = allocTotals();
+        if (perf) perf->start();
+        auto t0 = std::chrono::steady_clock::now();
+        r.ops = fn();
+        r.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+        AllocStats a1 = allocTotals();
+        r.allocs = AllocStats{a1.count - a0.count, a1.bytes - a0.bytes};
+        if (perf) {
+            r.counters = perf->stop();
+            r.hasCounters = true;
+        }
+        results.push_back(r);
+        std::cerr << "  " << name << " done\n";
+    }
+
+    // Attach a detail column to the phase measure() just recorded.
+    void note(const std::string& detail) { results.back().detail = detail; }
+
+    // For scenarios that time themselves.
+    void record(const BenchResult& r) {
+        results.push_back(r);
+        results.back().gated = gated;
+        std::cerr << "  " << r.scenario << " done\n";
+    }
+
+    std::vector<ScenarioRuns> byScenario() const {
+        std::vector<ScenarioRuns> out;
+        for (const auto& r : results) {
+            auto it = std::find_if(out.begin(), out.end(),
+                                   [&](const ScenarioRuns& s) { return s.scenario == r.scenario; });
+            if (it == out.end()) {
+                out.push_back(ScenarioRuns{r.scenario, {}});
+                it = out.end() - 1;
+            }
+            it->runs.push_back(&r);
+        }
+        return out;
+    }
+
+    void report(std::ostream& os) const {
+        os << std::left << std::setw(28) << "scenario" << std::right
+           << std::setw(12) << "ops" << std::setw(12) << "seconds"
+           << std::setw(12) << "us/op" << std::setw(14) << "ops/s";
+        if (perf) {
+            os << std::setw(12) << "cyc/op" << std::setw(12) << "ins/op" << std::setw(8) << "IPC"
+               << std::setw(12) << "llcmiss/op" << std::setw(12) << "brmiss/op";
+        }
+        if (kAllocProfile) os << std::setw(12) << "allocs/op" << std::setw(12) << "B/op";
+        os << "  detail\n";
+        for (const auto& group : byScenario()) {
+            const BenchResult& r = group.median();
+            os << std::left << std::setw(28) << r.scenario << std::right << std::fixed
+               << std::setw(12) << r.ops
+               << std::setw(12) << std::setprecision(4) << r.seconds
+               << std::setw(12) << std::setprecision(3) << (r.ops ? r.seconds * 1e6 / r.ops : 0)
+               << std::setw(14) << std::setprecision(0) << (r.seconds > 0 ? r.ops / r.seconds : 0);
+            if (perf) {
+                const PerfCounters::Sample& c = r.counters;
+                auto perOp = [&](int i, int width, int prec) {
+                    if (!r.hasCounters || !c.ok[i] || r.ops == 0) {
+                        os << std::setw(width) << "-";
+                    } else {
+                        os << std::setw(width) << std::setprecision(prec) << c.v[i] / r.ops;
+                    }
+                };
+                perOp(PerfCounters::Cycles, 12, 0);
+                perOp(PerfCounters::Instructions, 12, 0);
+                if (r.hasCounters && c.ok[PerfCounters::Cycles] && c.ok[PerfCounters::Instructions] &&
+                    c.v[PerfCounters::Cycles] > 0) {
+                    os << std::setw(8) << std::setprecision(2)
+                       << c.v[PerfCounters::Instructions] / c.v[PerfCounters::Cycles];
+                } else {
+                    os << std::setw(8) << "-";
+                }
+                perOp(PerfCounters::LlcMisses, 12, 2);
+                perOp(PerfCounters::BranchMisses, 12, 2);
+            }
+            if (kAllocProfile) {
+                double n = r.ops ? (double)r.ops : 1;
+                os << std::setw(12) << std::setprecision(2) << r.allocs.count / n
+                   << std::setw(12) << std::setprecision(1) << r.allocs.bytes / n;
+            }
+            os << "  " << r.detail;
+            if (group.runs.size() > 1) {
+                std::vector<double> v = group.usPerOp();
+                os << std::setprecision(3) << " [n=" << v.size() << " min=" << *std::min_element(v.begin(), v.end())
+                   << " max=" << *std::max_element(v.begin(), v.end()) << "]";
+            }
+            os << "\n";
+        }
+        if (kAllocProfile) {
+            os << "\nallocations by operation (all scenarios)\n";
+            for (int i = 0; i <= kLogOpCount; ++i) {
+                AllocStats s = allocStats(i);
+                if (s.count == 0) continue;
+                os << "  " << std::left << std::setw(20) << allocSlotName(i) << std::right
+                   << std::setw(14) << s.count << " calls" << std::setw(16) << s.bytes << " bytes\n";
+            }
+        }
+    }
+};
+
+// --- Baseline comparison ---
+
+// Baseline file: {"rows": N, "scenarios": {"name": [us/op, ...], ...}}
+void saveBaseline(const std::string& path, const Bench& b) {
+    std::ofstream f(path);
+    if (!f) throw std::runtime_error("cannot write baseline " + path);
+    f << "{\n  \"rows\": " << b.rows << ",\n  \"scenarios\": {";
+    bool first = true;
+    for (const auto& group : b.byScenario()) {
+        f << (first ? "\n" : ",\n") << "    \"" << group.scenario << "\": [";
+        first = false;
+        std::vector<double> v = group.usPerOp();
+        for (size_t i = 0; i < v.size(); ++i) f << (i ? ", " : "") << std::setprecision(17) << v[i];
+        f << "]";
+    }
+    f << "\n  }\n}\n";
+    if (!f) throw std::runtime_error("cannot write baseline " + path);
+}
+
+// Reads only the shape saveBaseline() writes; scenario names never contain
+// quotes or escapes.
+std::map<std::string, std::vector<double>> loadBaseline(const std::string& path, long long& rows) {
+    std::ifstream f(path);
+    if (!f) throw std::runtime_error("cannot read baseline " + path);
+    std::string text((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+    auto fail = [&]() -> std::runtime_error { return std::runtime_error("malformed baseline " + path); };
+
+    size_t p = text.find("\"rows\"");
+    if (p == std::string::npos) throw fail();
+    rows = std::atoll(text.c_str() + text.find(':', p) + 1);
+    p = text.find("\"scenarios\"");
+    if (p == std::string::npos || (p = text.find('{', p)) == std::string::npos) throw fail();
+
+    std::map<std::string, std::vector<double>> out;
+    for (;;) {
+        size_t q = text.find_first_of("\"}", p + 1);
+        if (q == std::string::npos) throw fail();
+        if (text[q] == '}') break;
+        size_t end = text.find('"', q + 1);
+        size_t open = text.find('[', end);
+        size_t close = text.find(']', open);
+        if (end == std::string::npos || open == std::string::npos || close == std::string::npos) throw fail();
+        std::vector<double>& v = out[text.substr(q + 1, end - q - 1)];
+        const char* c = text.c_str() + open + 1;
+        const char* stop = text.c_str() + close;
+        while (c < stop) {
+            char* next;
+            double x = std::strtod(c, &next);
+            if (next == c) {
+                ++c;
+            } else {
+                v.push_back(x);
+                c = next;
+            }
+        }
+        p = close;
+    }
+    return out;
+}
+
+// One-sided Mann-Whitney U test: probability, under "same distribution",
+// of a U at least as large as observed, where U counts pairs in which the
+// current sample is slower than the baseline one (ties count half). Exact
+// for small tie-free samples, normal approximation with tie correction
+// otherwise.
+double mannWhitneySlowerP(const std::vector<double>& cur, const std::vector<double>& base) {
+    int m = (int)cur.size(), n = (int)base.size();
+    if (m == 0 || n == 0) return 1;
+    double u = 0;
+    bool ties = false;
+    for (double x : cur) {
+        for (double y : base) {
+            if (x > y) u += 1;
+            else if (x == y) { u += 0.5; ties = true; }
+        }
+    }
+    if (!ties && m * n <= 400) {
+        // ways[i][j][k]: orderings of i current and j baseline values with U == k.
+        std::vector<std::vector<std::vector<double>>> ways(m + 1, std::vector<std::vector<double>>(n + 1));
+        for (int i = 0; i <= m; ++i) {
+            for (int j = 0; j <= n; ++j) {
+                std::vector<double>& w = ways[i][j];
+                w.assign(i * j + 1, 0);
+                if (i == 0 || j == 0) { w[0] = 1; continue; }
+                // The largest value is either current (beats all j) or baseline.
+                const std::vector<double>& a = ways[i - 1][j];
+                const std::vector<double>& b = ways[i][j - 1];
+                for (size_t k = 0; k < a.size(); ++k) w[k + j] += a[k];
+                for (size_t k = 0; k < b.size(); ++k) w[k] += b[k];
+            }
+        }
+        const std::vector<double>& w = ways[m][n];
+        double total = 0, tail = 0;
+        for (size_t k = 0; k < w.size(); ++k) {
+            total += w[k];
+            if ((double)k >= u) tail += w[k];
+        }
+        return tail / total;
+    }
+    std::vector<double> all(cur);
+    all.insert(all.end(), base.begin(), base.end());
+    std::sort(all.begin(), all.end());
+    double tieTerm = 0;
+    for (size_t i = 0; i < all.size();) {
+        size_t j = i;
+        while (j < all.size() && all[j] == all[i]) ++j;
+        double t = (double)(j - i);
+        tieTerm += t * t * t - t;
+        i = j;
+    }
+    double N = m + n;
+    double mean = m * n / 2.0;
+    double var = m * n / 12.0 * ((N + 1) - tieTerm / (N * (N - 1)));
+    if (var <= 0) return 1;
+    double z = (u - mean - 0.5) / std::sqrt(var);
+    return 0.5 * std::erfc(z / std::sqrt(2.0));
+}
+
+double median(std::vector<double> v) {
+    if (v.empty()) return 0;
+    std::sort(v.begin(), v.end());
+    size_t k = v.size() / 2;
+    return v.size() % 2 ? v[k] : (v[k - 1] + v[k]) / 2;
+}
+
+// Prints the comparison table; returns how many gated scenarios regressed.
+int compareToBaseline(std::ostream& os, const Bench& b, const std::string& path,
+                      double alpha, double thresholdPct) {
+    long long baseRows = 0;
+    std::map<std::string, std::vector<double>> base = loadBaseline(path, baseRows);
+    if (baseRows != b.rows) {
+        os << "warning: baseline ran with --rows " << baseRows << ", this run with " << b.rows << "\n";
+    }
+    os << std::defaultfloat << "\ncomparison with " << path << " (one-sided Mann-Whitney, alpha=" << alpha
+       << ", threshold=" << thresholdPct << "%)\n";
+    os << std::left << std::setw(28) << "scenario" << std::right << std::setw(12) << "base us/op"
+       << std::setw(12) << "now us/op" << std::setw(10) << "change" << std::setw(10) << "p"
+       << std::setw(6) << "n" << "  verdict\n";
+    int regressions = 0;
+    for (const auto& group : b.byScenario()) {
+        auto it = base.find(group.scenario);
+        os << std::left << std::setw(28) << group.scenario << std::right << std::fixed;
+        if (it == base.end() || it->second.empty()) {
+            os << std::setw(12) << "-" << std::setw(12) << std::setprecision(3) << median(group.usPerOp())
+               << std::setw(10) << "-" << std::setw(10) << "-" << std::setw(6) << "-" << "  new\n";
+            continue;
+        }
+        std::vector<double> cur = group.usPerOp();
+        double bm = median(it->second), cm = median(cur);
+        double change = bm > 0 ? (cm - bm) / bm * 100 : 0;
+        double pSlower = mannWhitneySlowerP(cur, it->second);
+        double pFaster = mannWhitneySlowerP(it->second, cur);
+        const char* verdict = "same";
+        if (pSlower < alpha && change > thresholdPct) {
+            verdict = group.runs.front()->gated ? "SLOWER" : "slower (not gated)";
+            if (group.runs.front()->gated) ++regressions;
+        } else if (pFaster < alpha && change < -thresholdPct) {
+            verdict = "faster";
+        }
+        os << std::setw(12) << std::setprecision(3) << bm << std::setw(12) << cm
+           << std::setw(9) << std::setprecision(1) << std::showpos << change << std::noshowpos << "%"
+           << std::setw(10) << std::setprecision(4) << std::min(pSlower, pFaster)
+           << std::setw(6) << (std::to_string(cur.size()) + "/" + std::to_string(it->second.size()))
+           << "  " << verdict << "\n";
+    }
+    os << (regressions ? std::to_string(regressions) + " CRUD scenario(s) regressed\n"
+                       : std::string("no significant CRUD regressions\n"));
+    return regressions;
+}
+
+Student makeStudent(long long i) {
+    static const char* grades[] = {"A+", "A", "B", "C", "D", "F"};
+    return Student{(int)i, "Student " + std::to_string(i), 18 + (int)(i % 10), grades[i % 6]};
+}
+
+void fill(DatabaseManager& dbm, long long n) {
+    for (long long i = 1; i <= n; ++i) dbm.addStudent(makeStudent(i));
+}
+
+// --- Scenarios ---
+
+// Write overhead of grade_history: same inserts/updates with it off and on.
+void benchGradeHistory(Bench& b) {
+    for (bool history : {false, true}) {
+        DatabaseOptions o;
+        o.gradeHistory = history;
+        DatabaseManager dbm(":memory:", "benchKey", o);
+        std::string tag = history ? "history" : "no-history";
+        b.measure("insert/" + tag, [&] {
+            fill(dbm, b.rows);
+            return b.rows;
+        });
+        b.measure("update/" + tag, [&] {
+            for (long long i = 1; i <= b.rows; ++i) dbm.updateStudentGrade((int)i, "B+");
+            return b.rows;
+        });
+    }
+}
+
+// asOf latency against a history several versions deep per student.
+void benchAsOf(Bench& b) {
+    DatabaseManager dbm(":memory:", "benchKey");
+    fill(dbm, b.rows);
+    long long mid = nowMicros();
+    const int versions = 4;
+    for (int v = 0; v < versions; ++v) {
+        for (long long i = 1; i <= b.rows; ++i) dbm.updateStudentGrade((int)i, v % 2 ? "A" : "C");
+    }
+    const int queries = 5;
+    b.measure("asof/mid-history", [&] {
+        size_t n = 0;
+        for (int q = 0; q < queries; ++q) n += dbm.asOf(mid).size();
+        if (n != (size_t)(queries * b.rows)) throw std::runtime_error("asOf returned wrong roster");
+        return (long long)queries;
+    });
+    b.measure("asof/now", [&] {
+        for (int q = 0; q < queries; ++q) dbm.asOf(nowMicros());
+        return (long long)queries;
+    });
+    b.measure("getall/reference", [&] {
+        for (int q = 0; q < queries; ++q) dbm.getAllStudents();
+        return (long long)queries;
+    });
+}
+
+// The four single-row operations on a table of b.rows students.
+void benchCrud(Bench& b) {
+    DatabaseOptions o;
+    o.gradeHistory = false;
+    DatabaseManager dbm(":memory:", "benchKey", o);
+    b.measure("crud/add", [&] {
+        fill(dbm, b.rows);
+        return b.rows;
+    });
+    b.measure("crud/get", [&] {
+        Student s;
+        for (long long i = 1; i <= b.rows; ++i) {
+            if (!dbm.getStudent((int)(1 + (i * 7919) % b.rows), s)) throw std::runtime_error("missing row");
+        }
+        return b.rows;
+    });
+    b.measure("crud/update", [&] {
+        for (long long i = 1; i <= b.rows; ++i) dbm.updateStudentGrade((int)i, "B");
+        return b.rows;
+    });
+    b.measure("crud/delete", [&] {
+        for (long long i = 1; i <= b.rows; ++i) dbm.deleteStudent((int)i);
+        return b.rows;
+    });
+}
+
+// Full-table reads, one op per row, so --perf columns read as per-row cost.
+void benchScan(Bench& b) {
+    DatabaseManager dbm(":memory:", "benchKey");
+    fill(dbm, b.rows);
+    const int passes = 5;
+    b.measure("scan/getall", [&] {
+        long long n = 0;
+        for (int p = 0; p < passes; ++p) n += (long long)dbm.getAllStudents().size();
+        return n;
+    });
+    b.measure("scan/foreach", [&] {
+        long long n = 0;
+        for (int p = 0; p < passes; ++p) n += (long long)dbm.forEachStudent([](const Student&) {});
+        return n;
+    });
+}
+
+double percentile(std::vector<double>& v, double p) {
+    if (v.empty()) return 0;
+    size_t k = std::min(v.size() - 1, (size_t)(p * v.size()));
+    std::nth_element(v.begin(), v.begin() + k, v.end());
+    return v[k];
+}
+
+// Open-loop load generator: a dispatcher enqueues a 90/10 point-read/update
+// mix at 2x the measured single-client capacity into an inbox served by 16
+// worker threads. Latency runs from arrival to completion, so backlog counts.
+// Without admission control the inbox grows for the whole run; with it,
+// excess requests are shed at the DatabaseManager and admitted latency stays
+// bounded. Shed requests are counted, not timed.
+void benchOverload(Bench& b) {
+    const int workers = 16;
+    const double seconds = 2.0;
+    typedef std::chrono::steady_clock Clock;
+    for (bool admission : {false, true}) {
+        DatabaseOptions o;
+        o.gradeHistory = false;
+        if (admission) {
+            o.pointReadLimits = AdmissionLimits{2, 2, 5};
+            o.writeLimits = AdmissionLimits{1, 1, 5};
+        }
+        DatabaseManager dbm(":memory:", "benchKey", o);
+        fill(dbm, b.rows);
+
+        auto op = [&](long long k) {
+            int id = (int)(1 + (k * 7919) % b.rows);
+            if (k % 10 == 0) {
+                dbm.updateStudentGrade(id, "B");
+            } else {
+                Student s;
+                dbm.getStudent(id, s);
+            }
+        };
+
+        // Capacity: one client, closed loop.
+        long long capOps = 0;
+        auto c0 = Clock::now();
+        while (Clock::now() - c0 < std::chrono::milliseconds(300)) op(capOps++);
+        double rate = 2 * capOps / 0.3;
+
+        std::mutex m;
+        std::condition_variable cv;
+        std::deque<std::pair<long long, Clock::time_point>> inbox;
+        bool done = false;
+        std::vector<std::vector<double>> lat(workers);
+        std::atomic<long long> shed(0);
+        std::vector<std::thread> pool;
+        for (int w = 0; w < workers; ++w) {
+            pool.emplace_back([&, w] {
+                for (;;) {
+                    std::pair<long long, Clock::time_point> req;
+                    {
+                        std::unique_lock<std::mutex> lock(m);
+                        cv.wait(lock, [&] { return done || !inbox.empty(); });
+                        if (inbox.empty()) return;
+                        req = inbox.front();
+                        inbox.pop_front();
+                    }
+                    try {
+                        op(req.first);
+                        lat[w].push_back(std::chrono::duration<double, std::micro>(Clock::now() - req.second).count());
+                    } catch (const Overloaded&) {
+                        ++shed;
+                    }
+                }
+            });
+        }
+
+        auto start = Clock::now();
+        long long total = (long long)(rate * seconds), issued = 0;
+        while (issued < total) {
+            double due = std::chrono::duration<double>(Clock::now() - start).count() * rate;
+            {
+                std::lock_guard<std::mutex> lock(m);
+                for (; issued < total && issued < (long long)due; ++issued) inbox.emplace_back(issued, Clock::now());
+            }
+            cv.notify_all();
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+        }
+        {
+            std::lock_guard<std::mutex> lock(m);
+            done = true;
+        }
+        cv.notify_all();
+        for (auto& t : pool) t.join();
+        double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+        std::vector<double> all;
+        for (auto& v : lat) all.insert(all.end(), v.begin(), v.end());
+        std::ostringstream detail;
+        detail << std::fixed << std::setprecision(0) << "offered=" << rate << "/s shed=" << shed
+               << " p50=" << percentile(all, 0.50) << "us p99=" << percentile(all, 0.99) << "us";
+        b.record({std::string("overload-2x/") + (admission ? "admission" : "no-admission"),
+                  (long long)all.size(), elapsed, detail.str()});
+    }
+}
+
+// 8 threads each render the same listing to /dev/null, either the old way
+// (lock one global mutex, format straight into the stream) or through
+// OutputSink (format into a per-thread buffer, one flusher writes).
+void benchRender(Bench& b) {
+    const int threads = 8, listings = 5;
+    std::vector<Student> rows;
+    for (long long i = 1; i <= b.rows; ++i) rows.push_back(makeStudent(i));
+    long long ops = (long long)threads * listings * b.rows;
+
+    std::ofstream devnull("/dev/null");
+    std::mutex globalMutex;
+    b.measure("render-8t/global-mutex", [&] {
+        std::vector<std::thread> pool;
+        for (int t = 0; t < threads; ++t) {
+            pool.emplace_back([&] {
+                for (int l = 0; l < listings; ++l) {
+                    std::lock_guard<std::mutex> lock(globalMutex);
+                    printHeader(devnull);
+                    for (const auto& s : rows) printRow(devnull, s);
+                    devnull.flush();
+                }
+            });
+        }
+        for (auto& t : pool) t.join();
+        return ops;
+    });
+
+    OutputSink sink(devnull);
+    b.measure("render-8t/output-sink", [&] {
+        std::vector<std::thread> pool;
+        for (int t = 0; t < threads; ++t) {
+            pool.emplace_back([&] {
+                for (int l = 0; l < listings; ++l) {
+                    renderBlock([&](std::ostream& os) {
+                        printHeader(os);
+                        for (const auto& s : rows) printRow(os, s);
+                    }, sink);
+                }
+            });
+        }
+        for (auto& t : pool) t.join();
+        sink.drain();
+        return ops;
+    });
+}
+
+// Discards output, noting when the first row (past the header) arrives.
+class FirstRowClock : public std::streambuf {
+private:
+    size_t bytes = 0;
+    size_t headerBytes;
+public:
+    std::chrono::steady_clock::time_point firstRow;
+    bool seen = false;
+
+    FirstRowClock() {
+        std::ostringstream h;
+        printHeader(h);
+        headerBytes = h.str().size();
+    }
+    void reset() {
+        bytes = 0;
+        seen = false;
+    }
+
+protected:
+    std::streamsize xsputn(const char*, std::streamsize n) override {
+        bytes += (size_t)n;
+        if (!seen && bytes > headerBytes) {
+            firstRow = std::chrono::steady_clock::now();
+            seen = true;
+        }
+        return n;
+    }
+    int overflow(int c) override {
+        char ch = (char)c;
+        if (c != EOF) xsputn(&ch, 1);
+        return c == EOF ? 0 : c;
+    }
+};
+
+// Menu listing: materialize, then decrypt-and-print on one thread
+// (getAllStudents + printStudents) vs pipelinedListing's three stages.
+// Detail shows time until the first row reached the output.
+void benchListing(Bench& b) {
+    DatabaseManager dbm(":memory:", "benchKey");
+    fill(dbm, b.rows);
+    FirstRowClock clock;
+    std::ostream devnull(&clock);
+    OutputSink sink(devnull);
+    typedef std::chrono::steady_clock Clock;
+    auto firstRowMs = [&](Clock::time_point t0) {
+        std::ostringstream d;
+        d << std::fixed << std::setprecision(2) << "first-row="
+          << std::chrono::duration<double, std::milli>(clock.firstRow - t0).count() << "ms";
+        return d.str();
+    };
+    for (bool pipelined : {false, true}) {
+        clock.reset();
+        auto t0 = Clock::now();
+        long long n;
+        if (pipelined) {
+            n = (long long)pipelinedListing(dbm, QueryControl(), sink);
+        } else {
+            std::vector<Student> all = dbm.getAllStudents();
+            renderBlock([&](std::ostream& os) {
+                printHeader(os);
+                for (const auto& s : all) printRow(os, s);
+            }, sink);
+            n = (long long)all.size();
+        }
+        sink.drain();
+        double secs = std::chrono::duration<double>(Clock::now() - t0).count();
+        b.record({pipelined ? "listing/pipelined" : "listing/sequential", n, secs, firstRowMs(t0)});
+    }
+}
+
+// Ad-hoc SQL through DatabaseManager::query: a grouped count over the
+// decrypted grades. Before timing, every statement the authorizer must
+// refuse (transaction, savepoint, attach/detach, pragma) is run once and
+// the scenario fails if any of them is accepted.
+void benchQuery(Bench& b) {
+    DatabaseManager dbm(":memory:", "benchKey");
+    fill(dbm, b.rows);
+    const char* refused[] = {
+        "BEGIN;", "COMMIT;", "SAVEPOINT s;", "RELEASE s;", "ATTACH ':memory:' AS other;", "DETACH main;",
+        "PRAGMA journal_mode;", "PRAGMA query_only = 1;", "SELECT * FROM pragma_table_info('students');",
+    };
+    for (const char* sql : refused) {
+        bool accepted = true;
+        try {
+            dbm.query(sql, [](const std::vector<std::string>&) {});
+        } catch (const std::exception&) {
+            accepted = false;
+        }
+        if (accepted) throw std::runtime_error(std::string("sql: query() accepted ") + sql);
+    }
+    const int passes = 5;
+    b.measure("sql/grade-counts", [&] {
+        long long n = 0;
+        for (int p = 0; p < passes; ++p) {
+            dbm.query("SELECT decrypt_grade(grade_enc), count(*) FROM students GROUP BY 1;",
+                      [&](const std::vector<std::string>& row) { n += std::atoll(row[1].c_str()); });
+        }
+        if (n != passes * b.rows) throw std::runtime_error("sql: wrong row count");
+        return n;
+    });
+    b.note(std::to_string(sizeof(refused) / sizeof(refused[0])) + " state-changing statements refused");
+}
+
+// SQLite heap under the system allocator vs SlabAllocator (and, where the
+// library has lookaside, a larger lookaside): single-thread inserts and
+// scans, then 8 threads mixing point reads, updates and counts.
+// "held-free" is memory the allocators keep but nothing uses after the
+// mixed phase: glibc's free arena bytes, plus unused slab bytes.
+void benchSqliteMalloc(Bench& b) {
+    struct Config {
+        const char* name;
+        SqliteAllocator alloc;
+        int laSize, laSlots;
+    };
+    std::vector<Config> configs = {{"system", SqliteAllocator::System, 0, 0},
+                                   {"slab", SqliteAllocator::Slab, 0, 0}};
+    if (sqliteHasLookaside()) {
+        configs.push_back({"system+lookaside", SqliteAllocator::System, 512, 1024});
+        configs.push_back({"slab+lookaside", SqliteAllocator::Slab, 512, 1024});
+    } else {
+        std::cerr << "  (libsqlite3 built with SQLITE_OMIT_LOOKASIDE: lookaside variants skipped)\n";
+    }
+    for (const Config& c : configs) {
+        installSqliteAllocator(c.alloc);
+        {
+            DatabaseOptions o;
+            o.gradeHistory = false;
+            o.lookasideSlotSize = c.laSize;
+            o.lookasideSlots = c.laSlots;
+            DatabaseManager dbm(":memory:", "benchKey", o);
+            std::string tag = c.name;
+            b.measure("sqlite-malloc/insert/" + tag, [&] {
+                fill(dbm, b.rows);
+                return b.rows;
+            });
+            b.measure("sqlite-malloc/scan/" + tag, [&] {
+                long long n = 0;
+                for (int p = 0; p < 5; ++p) n += (long long)dbm.forEachStudent([](const Student&) {});
+                return n;
+            });
+            const int threads = 8;
+            const long long perThread = b.rows / 2;
+            auto t0 = std::chrono::steady_clock::now();
+            std::vector<std::thread> pool;
+            for (int t = 0; t < threads; ++t) {
+                pool.emplace_back([&, t] {
+                    Student s;
+                    for (long long k = 0; k < perThread; ++k) {
+                        int id = (int)(1 + (k * 7919 + t * 104729) % b.rows);
+                        if (k % 10 == 0) dbm.updateStudentGrade(id, k % 20 ? "B" : "A");
+                        else if (k % 100 == 1) dbm.countStudents();
+                        else dbm.getStudent(id, s);
+                    }
+                });
+            }
+            for (auto& th : pool) th.join();
+            double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+            struct mallinfo2 mi = mallinfo2();
+            long long heldFree = (long long)mi.fordblks;
+            if (c.alloc == SqliteAllocator::Slab) {
+                heldFree += std::max(0LL, SlabAllocator::reservedBytes() - (long long)sqlite3_memory_used());
+            }
+            std::ostringstream d;
+            if (sqliteHasMemStatus()) {
+                d << "sqlite-used=" << sqlite3_memory_used() / 1024 << "KiB sqlite-peak="
+                  << sqlite3_memory_highwater(1) / 1024 << "KiB held-free=" << heldFree / 1024 << "KiB";
+            } else {
+                d << "sqlite-used=n/a sqlite-peak=n/a held-free=n/a";
+            }
+            b.record({"sqlite-malloc/mixed-8t/" + tag, threads * perThread, secs, d.str()});
+        }
+        installSqliteAllocator(SqliteAllocator::System);
+    }
+}
+
+// Id index candidates for MemoryStudentStore at each --keys size: ArtIndex
+// vs std::map vs std::unordered_map. Ids 1..n are inserted and probed in
+// two different shuffled orders (dense, like student ids). "scan" is one
+// ascending walk over all ids, which unordered_map can only do by copying
+// and sorting its keys. "read-4t" is 4 threads of point lookups while one
+// writer keeps updating; the std containers need a shared_mutex for that.
+// heap= is malloc'd bytes held after the build, measured the same way for
+// all three.
+void benchIdIndex(Bench& b) {
+    auto heapInUse = [] { return (long long)mallinfo2().uordblks; };
+    auto heapNote = [](long long bytes, long long n) {
+        std::ostringstream d;
+        d << std::fixed << std::setprecision(1) << "heap=" << bytes / 1048576.0 << "MiB ("
+          << (double)bytes / n << " B/key)";
+        return d.str();
+    };
+    for (long long n : b.indexKeys) {
+        std::vector<int> ids(n), probes(n);
+        std::iota(ids.begin(), ids.end(), 1);
+        probes = ids;
+        std::mt19937_64 rng(42);
+        std::shuffle(ids.begin(), ids.end(), rng);
+        std::shuffle(probes.begin(), probes.end(), rng);
+        std::string tag = "/" + std::to_string(n);
+        const int readers = 4;
+        const long long perReader = std::min<long long>(n, 1000000);
+
+        // Point lookups from `readers` threads while the caller updates.
+        auto concurrentReads = [&](const std::function<bool(int)>& lookup, const std::function<void(int)>& update) {
+            std::atomic<bool> done{false};
+            std::atomic<long long> misses{0};
+            std::vector<std::thread> pool;
+            for (int t = 0; t < readers; ++t) {
+                pool.emplace_back([&, t] {
+                    for (long long i = 0; i < perReader; ++i) {
+                        if (!lookup(probes[(i * readers + t) % n])) ++misses;
+                    }
+                });
+            }
+            std::thread writer([&] {
+                for (long long i = 0; !done.load(std::memory_order_relaxed); ++i) update(ids[i % n]);
+            });
+            for (auto& th : pool) th.join();
+            done = true;
+            writer.join();
+            if (misses) throw std::runtime_error("index lost keys under concurrent updates");
+            return readers * perReader;
+        };
+
+        {
+            long long h0 = heapInUse();
+            ArtIndex art;
+            b.measure("index/art/insert" + tag, [&] {
+                for (long long i = 0; i < n; ++i) art.insert(ids[i], (uint32_t)i);
+                return n;
+            });
+            b.note(heapNote(heapInUse() - h0, n));
+            b.measure("index/art/find" + tag, [&] {
+                uint32_t v;
+                for (long long i = 0; i < n; ++i) {
+                    if (!art.find(probes[i], v)) throw std::runtime_error("art: missing key");
+                }
+                return n;
+            });
+            b.measure("index/art/scan" + tag, [&] {
+                long long prev = 0;
+                size_t c = art.scan(INT_MIN, INT_MAX, [&](int id, uint32_t) {
+                    if (id <= prev) throw std::runtime_error("art: scan out of order");
+                    prev = id;
+                });
+                return (long long)c;
+            });
+            b.measure("index/art/read-4t" + tag, [&] {
+                return concurrentReads([&](int id) { uint32_t v; return art.find(id, v); },
+                                       [&](int id) { art.insert(id, (uint32_t)id); });
+            });
+        }
+        {
+            long long h0 = heapInUse();
+            std::map<int, uint32_t> m;
+            b.measure("index/map/insert" + tag, [&] {
+                for (long long i = 0; i < n; ++i) m.emplace(ids[i], (uint32_t)i);
+                return n;
+            });
+            b.note(heapNote(heapInUse() - h0, n));
+            b.measure("index/map/find" + tag, [&] {
+                for (long long i = 0; i < n; ++i) {
+                    if (m.find(probes[i]) == m.end()) throw std::runtime_error("map: missing key");
+                }
+                return n;
+            });
+            b.measure("index/map/scan" + tag, [&] {
+                long long c = 0;
+                for (const auto& e : m) c += e.first > 0;
+                return c;
+            });
+            std::shared_mutex mu;
+            b.measure("index/map/read-4t" + tag, [&] {
+                return concurrentReads([&](int id) { std::shared_lock<std::shared_mutex> l(mu); return m.count(id) > 0; },
+                                       [&](int id) { std::unique_lock<std::shared_mutex> l(mu); m[id] = (uint32_t)id; });
+            });
+        }
+        {
+            long long h0 = heapInUse();
+            std::unordered_map<int, uint32_t> h;
+            b.measure("index/unordered_map/insert" + tag, [&] {
+                for (long long i = 0; i < n; ++i) h.emplace(ids[i], (uint32_t)i);
+                return n;
+            });
+            b.note(heapNote(heapInUse() - h0, n));
+            b.measure("index/unordered_map/find" + tag, [&] {
+                for (long long i = 0; i < n; ++i) {
+                    if (h.find(probes[i]) == h.end()) throw std::runtime_error("unordered_map: missing key");
+                }
+                return n;
+            });
+            b.measure("index/unordered_map/scan" + tag, [&] {
+                std::vector<int> keys;
+                keys.reserve(h.size());
+                for (const auto& e : h) keys.push_back(e.first);
+                std::sort(keys.begin(), keys.end());
+                return (long long)keys.size();
+            });
+            std::shared_mutex mu;
+            b.measure("index/unordered_map/read-4t" + tag, [&] {
+                return concurrentReads([&](int id) { std::shared_lock<std::shared_mutex> l(mu); return h.count(id) > 0; },
+                                       [&](int id) { std::unique_lock<std::shared_mutex> l(mu); h[id] = (uint32_t)id; });
+            });
+        }
+    }
+}
+
+// Rows for the columnar scenarios, generated rather than read from SQLite
+// so millions of rows cost seconds to set up.
+void generateStudents(long long n, const std::function<void(const Student&)>& emit) {
+    for (long long i = 1; i <= n; ++i) emit(makeStudent(i));
+}
+
+// AnonHugePages of this process in KiB (THP actually in use), -1 if unknown.
+long long anonHugePagesKb() {
+    std::ifstream f("/proc/self/smaps_rollup");
+    for (std::string line; std::getline(f, line);) {
+        if (line.compare(0, 14, "AnonHugePages:") == 0) return std::atoll(line.c_str() + 14);
+    }
+    return -1;
+}
+
+// MemoryStudentStore loaded from the SQLite store. After every reload its
+// forEach() must match getAllStudents() row for row. "reload-4t" changes a
+// tenth of the rows (grade updates, deletes, inserts) and reloads while 4
+// threads keep reading the store; ids the batch leaves alone must never be
+// missing. "reload-churn" reloads 20 rounds of updates; slots= shows the
+// row slots allocated by the end, which must stay close to the row count.
+void benchMemoryStore(Bench& b) {
+    DatabaseManager dbm(":memory:", "benchKey");
+    fill(dbm, b.rows);
+    MemoryStudentStore store;
+    auto check = [&] {
+        std::vector<Student> all = dbm.getAllStudents();
+        size_t i = 0;
+        store.forEach([&](const Student& s) {
+            if (i >= all.size() || s.id != all[i].id || s.name != all[i].name || s.age != all[i].age ||
+                s.grade != all[i].grade) {
+                throw std::runtime_error("memstore: forEach differs from getAllStudents");
+            }
+            ++i;
+        });
+        if (i != all.size()) throw std::runtime_error("memstore: forEach differs from getAllStudents");
+    };
+    b.measure("memstore/reload", [&] { return (long long)store.reload(dbm); });
+    check();
+    const int passes = 5;
+    b.measure("memstore/foreach", [&] {
+        long long n = 0;
+        for (int p = 0; p < passes; ++p) n += (long long)store.forEach([](const Student&) {});
+        return n;
+    });
+    b.measure("memstore/get", [&] {
+        Student s;
+        for (long long i = 1; i <= b.rows; ++i) {
+            if (!store.get((int)i, s)) throw std::runtime_error("memstore: missing id");
+        }
+        return b.rows;
+    });
+
+    // Ids divisible by 10 toggle between deleted and present; their
+    // neighbours get a new grade (a new row version) and stay readable.
+    Student s;
+    for (long long i = 10; i <= b.rows; i += 10) {
+        if (dbm.getStudent((int)i, s)) {
+            dbm.deleteStudent((int)i);
+        } else {
+            dbm.addStudent(makeStudent(i));
+        }
+        dbm.updateStudentGrade((int)(i - 1), i % 20 ? "F" : "A");
+    }
+    for (long long i = 1; i <= 100; ++i) dbm.addStudent(makeStudent(b.rows + i));
+    b.measure("memstore/reload-4t", [&] {
+        std::atomic<bool> done{false};
+        std::atomic<long long> misses{0};
+        std::vector<std::thread> readers;
+        for (int t = 0; t < 4; ++t) {
+            readers.emplace_back([&, t] {
+                Student s;
+                for (long long i = 1 + t; !done.load(std::memory_order_relaxed); i = i % b.rows + 1) {
+                    if (i % 10 && !store.get((int)i, s)) ++misses;
+                }
+            });
+        }
+        long long n = (long long)store.reload(dbm);
+        done = true;
+        for (auto& th : readers) th.join();
+        if (misses) throw std::runtime_error("memstore: reads missed unchanged ids during reload");
+        return n;
+    });
+    check();
+
+    // Repeated reloads, each changing a tenth of the rows, must reuse the
+    // slots of superseded versions instead of allocating new ones.
+    const int rounds = 20;
+    b.measure("memstore/reload-churn", [&] {
+        long long n = 0;
+        for (int r = 0; r < rounds; ++r) {
+            for (long long i = 1 + r % 10; i <= b.rows; i += 10) {
+                dbm.updateStudentGrade((int)i, r % 2 ? "B" : "C");
+            }
+            n += (long long)store.reload(dbm);
+        }
+        return n;
+    });
+    check();
+    if (store.slotsAllocated() > 2 * store.size() + 1024) {
+        throw std::runtime_error("memstore: reload does not reuse row slots");
+    }
+    b.note("slots=" + std::to_string(store.slotsAllocated()) + " rows=" + std::to_string(store.size()));
+}
+
+// StudentSnapshot placement: first-touch (unpinned workers, default memory
+// policy) vs node-bound partitions with pinned workers, each with 4 KiB,
+// transparent and explicit huge pages. Same partition count everywhere, so
+// only placement and page size differ. "scan" is 5 aggregate() passes over
+// the age and grade columns; GB/s counts column bytes read.
+void benchNuma(Bench& b) {
+    const NumaTopology& topo = NumaTopology::get();
+    long long n = b.snapshotRows;
+    std::cerr << "  " << topo.nodes() << " NUMA node(s) with CPUs\n";
+    struct Config {
+        const char* name;
+        bool placement;
+        HugePages hp;
+    };
+    const Config configs[] = {
+        {"first-touch/4k", false, HugePages::Off},      {"first-touch/thp", false, HugePages::Transparent},
+        {"numa/4k", true, HugePages::Off},              {"numa/thp", true, HugePages::Transparent},
+        {"numa/hugetlb", true, HugePages::Explicit},
+    };
+    for (const Config& c : configs) {
+        SnapshotOptions o;
+        o.numaPlacement = c.placement;
+        o.hugePages = c.hp;
+        o.partitionsPerNode = c.placement ? 2 : 2 * topo.nodes();
+        std::unique_ptr<StudentSnapshot> snap;
+        long long thp0 = anonHugePagesKb();
+        b.measure(std::string("numa/build/") + c.name, [&] {
+            snap = StudentSnapshot::build([&](const std::function<void(const Student&)>& emit) {
+                generateStudents(n, emit);
+            }, o);
+            return n;
+        });
+        const SnapshotPartition& p0 = *snap->partitions()[0];
+        std::ostringstream d;
+        HugePages pages = p0.ageBuf.pages();
+        d << "pages=" << (pages == HugePages::Explicit ? "hugetlb" : pages == HugePages::Transparent ? "thp" : "4k")
+          << " bound=" << (p0.ageBuf.bound() ? "yes" : "no");
+        long long thp1 = anonHugePagesKb();
+        if (thp0 >= 0 && thp1 >= 0) d << " thp=" << (thp1 - thp0) / 1024 << "MiB";
+        b.note(d.str());
+        const int passes = 5;
+        auto t0 = std::chrono::steady_clock::now();
+        for (int i = 0; i < passes; ++i) {
+            if (snap->aggregate().count != (size_t)n) throw std::runtime_error("snapshot lost rows");
+        }
+        double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+        std::ostringstream g;
+        g << std::fixed << std::setprecision(2) << "GB/s=" << passes * n * 5.0 / secs / 1e9;
+        b.record({std::string("numa/scan/") + c.name, passes * n, secs, g.str()});
+    }
+}
+
+// CompressedSnapshot vs the raw StudentSnapshot columns it was built from.
+// "decode" phases fully decompress one column (GB/s of decoded bytes, next
+// to the compression ratio); "raw"/"packed" phases run the same kernel over
+// the raw and the compressed column (5 passes for the scans, 10000 random
+// ids for the lookup).
+void benchCompress(Bench& b) {
+    long long n = b.snapshotRows;
+    std::unique_ptr<StudentSnapshot> snap = StudentSnapshot::build(
+        [&](const std::function<void(const Student&)>& emit) { generateStudents(n, emit); });
+    std::unique_ptr<CompressedSnapshot> cs;
+    b.measure("compress/encode", [&] {
+        cs = CompressedSnapshot::compress(*snap);
+        return n;
+    });
+    b.note(std::to_string(cs->symbols().symbolCount()) + " symbols");
+
+    auto decode = [&](const char* column, CompressedSnapshot::ColumnBytes bytes, size_t decodedBytes,
+                      const std::function<void(const CompressedPartition&)>& fn) {
+        auto t0 = std::chrono::steady_clock::now();
+        for (const auto& p : cs->partitions()) fn(*p);
+        double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+        std::ostringstream d;
+        d << std::fixed << std::setprecision(2) << "ratio=" << (double)bytes.raw / bytes.compressed
+          << " GB/s=" << decodedBytes / secs / 1e9;
+        b.record({std::string("compress/decode/") + column, n, secs, d.str()});
+    };
+    std::vector<int32_t> ints((size_t)n);
+    decode("ids", cs->ids(), n * sizeof(int32_t), [&](const CompressedPartition& p) { cs->decodeIds(p, ints.data()); });
+    decode("ages", cs->ages(), n * sizeof(int32_t), [&](const CompressedPartition& p) { cs->decodeAges(p, ints.data()); });
+    size_t nameBytes = 0;
+    for (const auto& p : snap->partitions()) nameBytes += p->nameBytes();
+    std::string heap;
+    std::vector<uint32_t> offsets;
+    decode("names", cs->names(), nameBytes, [&](const CompressedPartition& p) { cs->decodeNames(p, heap, offsets); });
+
+    const int passes = 5;
+    size_t expect = cs->countAgeBetween(20, 22);
+    b.measure("compress/age-range/raw", [&] {
+        for (int i = 0; i < passes; ++i) {
+            std::atomic<size_t> c{0};
+            snap->parallelScan([&](const SnapshotPartition& p, size_t) {
+                size_t k = 0;
+                for (size_t r = 0; r < p.rows; ++r) k += p.ages[r] >= 20 && p.ages[r] <= 22;
+                c += k;
+            });
+            if (c != expect) throw std::runtime_error("age range mismatch");
+        }
+        return passes * n;
+    });
+    b.measure("compress/age-range/packed", [&] {
+        for (int i = 0; i < passes; ++i) {
+            if (cs->countAgeBetween(20, 22) != expect) throw std::runtime_error("age range mismatch");
+        }
+        return passes * n;
+    });
+
+    std::string needle = makeStudent(n / 2).name;
+    b.measure("compress/name-eq/raw", [&] {
+        for (int i = 0; i < passes; ++i) {
+            std::atomic<size_t> c{0};
+            snap->parallelScan([&](const SnapshotPartition& p, size_t) {
+                size_t k = 0;
+                for (size_t r = 0; r < p.rows; ++r) {
+                    size_t len = p.nameOffsets[r + 1] - p.nameOffsets[r];
+                    k += len == needle.size() && std::memcmp(p.names + p.nameOffsets[r], needle.data(), len) == 0;
+                }
+                c += k;
+            });
+            if (c != 1) throw std::runtime_error("name scan mismatch");
+        }
+        return passes * n;
+    });
+    b.measure("compress/name-eq/packed", [&] {
+        for (int i = 0; i < passes; ++i) {
+            if (cs->countNameEquals(needle) != 1) throw std::runtime_error("name scan mismatch");
+        }
+        return passes * n;
+    });
+
+    std::mt19937 rng(42);
+    b.measure("compress/find-id/packed", [&] {
+        Student s;
+        for (int i = 0; i < 10000; ++i) {
+            int id = 1 + (int)(rng() % (uint32_t)n);
+            if (!cs->findId(id, s) || s.id != id) throw std::runtime_error("id lookup failed");
+        }
+        return 10000;
+    });
+}
+
+// Sketch upkeep and answers. The "sketch/db-*" phases repeat crud's writes
+// with DatabaseOptions::sketches on (compare with crud/*); approximate() is
+// timed against the exact aggregate() scan it replaces. "sketch/insert"
+// feeds --snapshot-rows generated rows straight into a StudentSketches and
+// notes each estimate's error next to its published bound.
+void benchSketches(Bench& b) {
+    DatabaseOptions o;
+    o.gradeHistory = false;
+    o.sketches = true;
+    DatabaseManager dbm(":memory:", "benchKey", o);
+    b.measure("sketch/db-add", [&] {
+        fill(dbm, b.rows);
+        return b.rows;
+    });
+    b.measure("sketch/db-update", [&] {
+        for (long long i = 1; i <= b.rows; ++i) dbm.updateStudentGrade((int)i, "B");
+        return b.rows;
+    });
+    const int reps = 1000;
+    b.measure("sketch/approximate", [&] {
+        for (int i = 0; i < reps; ++i) {
+            if (dbm.approximate().count != b.rows) throw std::runtime_error("sketch lost rows");
+        }
+        return reps;
+    });
+    b.measure("sketch/aggregate-exact", [&] {
+        if (dbm.aggregate().count != (size_t)b.rows) throw std::runtime_error("aggregate lost rows");
+        return 1;
+    });
+    b.measure("sketch/db-delete", [&] {
+        for (long long i = 1; i <= b.rows; ++i) dbm.deleteStudent((int)i);
+        return b.rows;
+    });
+
+    long long n = b.snapshotRows;
+    StudentSketches sk;
+    std::map<std::string, long long> grades;
+    b.measure("sketch/insert", [&] {
+        generateStudents(n, [&](const Student& s) { sk.insert(s); });
+        return n;
+    });
+    generateStudents(n, [&](const Student& s) { ++grades[s.grade]; });
+    ApproxStats a = sk.summary();
+    long long gradeErr = 0;
+    for (const auto& g : grades) gradeErr = std::max(gradeErr, std::llabs(a.grades[g.first] - g.second));
+    std::ostringstream d;
+    // makeStudent: every name distinct, ages 18 + i % 10 (median 22.5).
+    d << std::setprecision(3) << "names " << 100 * (a.distinctNames - n) / n << "% (1s "
+      << 100 * a.distinctNamesError << "%) p50=" << a.ageP50 << " grades +" << gradeErr << " (<=" << a.gradeError
+      << ")";
+    b.note(d.str());
+}
+
+// "Name contains X" over --snapshot-rows names: NameSearch with the best
+// SIMD kernel on all cores and on one, the scalar kernel, and SQLite's
+// LIKE '%x%' over the same rows in a :memory: table (also case-insensitive
+// for ASCII). Each phase runs every needle once; GB/s counts name bytes.
+void benchSubstring(Bench& b) {
+    long long n = b.snapshotRows;
+    std::unique_ptr<StudentSnapshot> snap = StudentSnapshot::build(
+        [&](const std::function<void(const Student&)>& emit) { generateStudents(n, emit); });
+    size_t heapBytes = 0;
+    for (const auto& p : snap->partitions()) heapBytes += p->nameBytes();
+    const char* needles[] = {"udent 4242", "STUDENT 1999", "zq"};
+    const size_t nNeedles = sizeof(needles) / sizeof(needles[0]);
+    std::vector<size_t> expect(nNeedles);
+    for (size_t i = 0; i < nNeedles; ++i) expect[i] = NameSearch(needles[i]).run(*snap, nullptr, 1, NameSearch::Kernel::Scalar);
+
+    auto phase = [&](const std::string& name, const std::function<size_t(const NameSearch&)>& search) {
+        auto t0 = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < nNeedles; ++i) {
+            if (search(NameSearch(needles[i])) != expect[i]) throw std::runtime_error(name + ": wrong match count");
+        }
+        double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+        std::ostringstream d;
+        d << std::fixed << std::setprecision(2) << "GB/s=" << nNeedles * heapBytes / secs / 1e9;
+        b.record({"substring/" + name, (long long)nNeedles * n, secs, d.str()});
+    };
+    size_t cores = std::max(1u, std::thread::hardware_concurrency());
+    if (cores > 1) {
+        phase(std::string(NameSearch::bestKernel()) + "-" + std::to_string(cores) + "t",
+              [&](const NameSearch& s) { return s.run(*snap, nullptr, cores); });
+    }
+    phase(std::string(NameSearch::bestKernel()) + "-1t", [&](const NameSearch& s) { return s.run(*snap, nullptr, 1); });
+    phase("scalar-1t", [&](const NameSearch& s) { return s.run(*snap, nullptr, 1, NameSearch::Kernel::Scalar); });
+
+    DatabaseOptions o;
+    o.gradeHistory = false;
+    DatabaseManager dbm(":memory:", "benchKey", o);
+    std::vector<Student> batch;
+    generateStudents(n, [&](const Student& s) {
+        batch.push_back(s);
+        if (batch.size() == 100000) {
+            dbm.addStudents(batch);
+            batch.clear();
+        }
+    });
+    dbm.addStudents(batch);
+    auto t0 = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < nNeedles; ++i) {
+        size_t got = 0;
+        dbm.query(std::string("SELECT count(*) FROM students WHERE name LIKE '%") + needles[i] + "%';",
+                  [&](const std::vector<std::string>& row) { got = (size_t)std::atoll(row[0].c_str()); });
+        if (got != expect[i]) throw std::runtime_error("substring/sqlite-like: wrong match count");
+    }
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    std::ostringstream d;
+    d << std::fixed << std::setprecision(2) << "GB/s=" << nNeedles * heapBytes / secs / 1e9;
+    b.record({"substring/sqlite-like", (long long)nNeedles * n, secs, d.str()});
+}
+
+// Duplicate audit over --snapshot-rows rows where every tenth row repeats
+// the previous row's name (upper-cased, padded) and age under a new id,
+// on one worker and on all cores. Snapshot build is not timed.
+void benchDuplicates(Bench& b) {
+    long long n = b.snapshotRows;
+    std::unique_ptr<StudentSnapshot> snap = StudentSnapshot::build(
+        [&](const std::function<void(const Student&)>& emit) {
+            for (long long i = 1; i <= n; ++i) {
+                Student s = makeStudent(i);
+                if (i % 10 == 0) {
+                    Student prev = makeStudent(i - 1);
+                    s.name = "  " + prev.name + " ";
+                    for (char& c : s.name) c = (char)std::toupper((unsigned char)c);
+                    s.age = prev.age;
+                }
+                emit(s);
+            }
+        });
+    size_t cores = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<size_t> configs{1};
+    if (cores > 1) configs.push_back(cores);
+    for (size_t threads : configs) {
+        DuplicateReport rep;
+        b.measure("dedup/" + std::to_string(threads) + "t", [&] {
+            rep = DuplicateFinder(*snap, threads).run();
+            return n;
+        });
+        if (rep.clusters.size() != (size_t)(n / 10)) throw std::runtime_error("dedup: wrong cluster count");
+        b.note(std::to_string(rep.clusters.size()) + " clusters, " + std::to_string(rep.partitions) + " partitions");
+    }
+}
+
+struct Scenario {
+    const char* name;
+    void (*run)(Bench&);
+    bool crud; // regressions here fail a --baseline comparison
+};
+
+const Scenario kScenarios[] = {
+    {"crud", benchCrud, true},
+    {"scan", benchScan, true},
+    {"history", benchGradeHistory, true},
+    {"asof", benchAsOf, false},
+    {"overload", benchOverload, false},
+    {"render", benchRender, false},
+    {"listing", benchListing, false},
+    {"sql", benchQuery, false},
+    {"sqlite-malloc", benchSqliteMalloc, false},
+    {"index", benchIdIndex, false},
+    {"memstore", benchMemoryStore, false},
+    {"numa", benchNuma, false},
+    {"compress", benchCompress, false},
+    {"sketch", benchSketches, false},
+    {"substring", benchSubstring, false},
+    {"dedup", benchDuplicates, false},
+};
+
+int main(int argc, char** argv) {
+    // Heap accounting on in every build, so sqlite-used, sqlite-peak,
+    // held-free and mem.sqlite.* compare like for like between the system
+    // library and sqlite_amalgamation.sh's DEFAULT_MEMSTATUS=0 build.
+    enableSqliteMemStatus();
+    Bench b;
+    std::string filter, savePath, baselinePath;
+    int reps = 1;
+    double alpha = 0.05, thresholdPct = 5;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--rows" && i + 1 < argc) {
+            b.rows = std::atoll(argv[++i]);
+        } else if (arg == "--keys" && i + 1 < argc) {
+            b.indexKeys.clear();
+            std::stringstream list(argv[++i]);
+            for (std::string k; std::getline(list, k, ',');) {
+                if (std::atoll(k.c_str()) > 0) b.indexKeys.push_back(std::atoll(k.c_str()));
+            }
+        } else if (arg == "--snapshot-rows" && i + 1 < argc) {
+            b.snapshotRows = std::max(1LL, std::atoll(argv[++i]));
+        } else if (arg == "--filter" && i + 1 < argc) {
+            filter = argv[++i];
+        } else if (arg == "--perf") {
+            b.enablePerf();
+        } else if (arg == "--reps" && i + 1 < argc) {
+            reps = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--save-baseline" && i + 1 < argc) {
+            savePath = argv[++i];
+        } else if (arg == "--baseline" && i + 1 < argc) {
+            baselinePath = argv[++i];
+        } else if (arg == "--alpha" && i + 1 < argc) {
+            alpha = std::atof(argv[++i]);
+        } else if (arg == "--threshold" && i + 1 < argc) {
+            thresholdPct = std::atof(argv[++i]);
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--rows N] [--keys N,N...] [--snapshot-rows N]\n"
+                      << "       [--filter SUBSTRING] [--perf] [--reps N]\n"
+                      << "       [--save-baseline FILE] [--baseline FILE] [--alpha P] [--threshold PCT]\n";
+            return 2;
+        }
+    }
+    std::cerr << "sqlite " << sqlite3_libversion() << " threadsafe=" << sqlite3_threadsafe()
+              << (sqliteHasLookaside() ? "" : " lookaside=omitted") << "\n";
+    int regressions = 0;
+    try {
+        // Repetitions interleave scenarios so slow drift (thermal, other
+        // tenants) spreads across all of them instead of biasing one.
+        for (int r = 0; r < reps; ++r) {
+            for (const auto& sc : kScenarios) {
+                if (!filter.empty() && std::string(sc.name).find(filter) == std::string::npos) continue;
+                std::cerr << sc.name;
+                if (reps > 1) std::cerr << " (rep " << r + 1 << "/" << reps << ")";
+                std::cerr << "\n";
+                b.gated = sc.crud;
+                sc.run(b);
+            }
+        }
+        b.report(std::cout);
+        if (!savePath.empty()) saveBaseline(savePath, b);
+        if (!baselinePath.empty()) regressions = compareToBaseline(std::cout, b, baselinePath, alpha, thresholdPct);
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        return 1;
+    }
+    return regressions ? 3 : 0;
+}
@@ -0,0 +1,413 @@
+/*
+ * sdms_native: CPython extension over the C++ store (sdms.cpp)
+ * -----------------------------------------------------------
+ * Gives Python jobs the C++ DatabaseManager fast paths instead of
+ * sdms.py's per-row execute/commit and per-row decrypt loop:
+ *   - add_students(rows): bulk insert, one transaction per chunk
+ *   - scan() / scan_batches(fn, batch_rows): columnar reads
+ *   - aggregate(), count(): computed natively, nothing per row crosses over
+ * The GIL is released while SQLite runs.
+ *
+ * Columnar batches are dicts of read-only memoryviews:
+ *   "id", "age"                      int32 ('i'), one entry per row
+ *   "name", "grade"                  UTF-8 bytes of all values concatenated
+ *   "name_offsets", "grade_offsets"  int64 ('q'), rows + 1 entries; value i
+ *                                    is data[offsets[i]:offsets[i + 1]]
+ * numpy.frombuffer() / pyarrow accept these without copying; strings()
+ * turns a string column back into a list of str.
+ *
+ * Databases are the C++ format (grade_enc XOR-encrypted with the key), not
+ * the Fernet-encrypted files written by sdms.py.
+ *
+ * Build (Linux):
+ *   g++ -O2 -shared -fPIC $(python3-config --includes) sdms_native.cpp \
+ *       -o sdms_native$(python3-config --extension-suffix) -lsqlite3 -lpthread
+ *
+ * Usage:
+ *   import sdms_native
+ *   db = sdms_native.Database("students.db")
+ *   db.add_students((i, f"Student {i}", 20, "A") for i in range(1, 1_000_001))
+ *   db.scan_batches(lambda b: process(b["id"], b["age"]), 65536)
+ *   print(db.aggregate())
+ */
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#define SDMS_NO_MAIN
+#include "sdms.cpp"
+
+namespace {
+
+// Raised from a scan callback to unwind out of forEachStudent once the
+// Python callback has set an exception.
+struct PythonError {};
+
+// Rows collected column by column until handed to Python.
+struct ColumnBatch {
+    std::vector<int32_t> ids, ages;
+    std::string names, grades;
+    std::vector<int64_t> nameOffsets{0}, gradeOffsets{0};
+
+    size_t size() const { return ids.size(); }
+
+    void add(const Student& s) {
+        ids.push_back(s.id);
+        ages.push_back(s.age);
+        names += s.name;
+        nameOffsets.push_back((int64_t)names.size());
+        grades += s.grade;
+        gradeOffsets.push_back((int64_t)grades.size());
+    }
+
+    void clear() {
+        ids.clear();
+        ages.clear();
+        names.clear();
+        grades.clear();
+        nameOffsets.assign(1, 0);
+        gradeOffsets.assign(1, 0);
+    }
+
+    // Copies the bytes into a bytes object and returns a memoryview of it
+    // cast to format, or the bytes object itself when format is null.
+    static PyObject* column(const void* data, size_t bytes, const char* format) {
+        PyObject* raw = PyBytes_FromStringAndSize(static_cast<const char*>(data), (Py_ssize_t)bytes);
+        if (!raw || !format) return raw;
+        PyObject* view = PyMemoryView_FromObject(raw);
+        Py_DECREF(raw);
+        if (!view) return nullptr;
+        PyObject* typed = PyObject_CallMethod(view, "cast", "s", format);
+        Py_DECREF(view);
+        return typed;
+    }
+
+    PyObject* toDict() const {
+        PyObject* d = PyDict_New();
+        if (!d) return nullptr;
+        struct { const char* key; PyObject* value; } cols[] = {
+            {"id", column(ids.data(), ids.size() * sizeof(int32_t), "i")},
+            {"age", column(ages.data(), ages.size() * sizeof(int32_t), "i")},
+            {"name", column(names.data(), names.size(), nullptr)},
+            {"name_offsets", column(nameOffsets.data(), nameOffsets.size() * sizeof(int64_t), "q")},
+            {"grade", column(grades.data(), grades.size(), nullptr)},
+            {"grade_offsets", column(gradeOffsets.data(), gradeOffsets.size() * sizeof(int64_t), "q")},
+        };
+        bool ok = true;
+        for (auto& c : cols) {
+            if (!c.value || PyDict_SetItemString(d, c.key, c.value) != 0) ok = false;
+            Py_XDECREF(c.value);
+        }
+        if (!ok) {
+            Py_DECREF(d);
+            return nullptr;
+        }
+        return d;
+    }
+};
+
+struct DatabaseObject {
+    PyObject_HEAD
+    DatabaseManager* dbm;
+};
+
+// Converts a Python int to a C int; sets OverflowError when it does not fit.
+bool toInt(PyObject* o, const char* field, int& out) {
+    long v = PyLong_AsLong(o);
+    if (v == -1 && PyErr_Occurred()) return false;
+    if (v < INT_MIN || v > INT_MAX) {
+        PyErr_Format(PyExc_OverflowError, "add_students: %s %ld is out of range for a C int", field, v);
+        return false;
+    }
+    out = (int)v;
+    return true;
+}
+
+// Reads one (id, name, age, grade) item; sets a Python error and returns
+// false if it is not a 4-sequence of int, str, int, str.
+bool toStudent(PyObject* item, Student& s) {
+    PyObject* seq = PySequence_Fast(item, "add_students: each row must be a sequence (id, name, age, grade)");
+    if (!seq) return false;
+    bool ok = false;
+    if (PySequence_Fast_GET_SIZE(seq) != 4) {
+        PyErr_SetString(PyExc_ValueError, "add_students: each row must have 4 fields (id, name, age, grade)");
+    } else {
+        PyObject** f = PySequence_Fast_ITEMS(seq);
+        int id = 0, age = 0;
+        Py_ssize_t nameLen = 0, gradeLen = 0;
+        const char* name = toInt(f[0], "id", id) && toInt(f[2], "age", age)
+                               ? PyUnicode_AsUTF8AndSize(f[1], &nameLen) : nullptr;
+        const char* grade = name ? PyUnicode_AsUTF8AndSize(f[3], &gradeLen) : nullptr;
+        if (grade) {
+            s.id = id;
+            s.age = age;
+            s.name.assign(name, (size_t)nameLen);
+            s.grade.assign(grade, (size_t)gradeLen);
+            ok = true;
+        }
+    }
+    Py_DECREF(seq);
+    return ok;
+}
+
+// Runs fn with the GIL released; C++ exceptions become RuntimeError.
+template <class F>
+bool withoutGil(F fn) {
+    std::string error;
+    Py_BEGIN_ALLOW_THREADS
+    try {
+        fn();
+    } catch (const std::exception& e) {
+        error = e.what();
+        if (error.empty()) error = "unknown error";
+    }
+    Py_END_ALLOW_THREADS
+    if (error.empty()) return true;
+    PyErr_SetString(PyExc_RuntimeError, error.c_str());
+    return false;
+}
+
+int Database_init(DatabaseObject* self, PyObject* args, PyObject* kwargs) {
+    static const char* kwlist[] = {"path", "key", "memory", "history", nullptr};
+    const char* path;
+    const char* key = "mySecretKey";
+    int memory = 0, history = 1;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s|spp", const_cast<char**>(kwlist),
+                                     &path, &key, &memory, &history)) {
+        return -1;
+    }
+    DatabaseOptions opts;
+    opts.inMemory = memory != 0;
+    opts.gradeHistory = history != 0;
+    std::string dbPath = path, xorKey = key;
+    DatabaseManager* dbm = nullptr;
+    if (!withoutGil([&] { dbm = new DatabaseManager(dbPath, xorKey, opts); })) return -1;
+    delete self->dbm;
+    self->dbm = dbm;
+    return 0;
+}
+
+void Database_dealloc(DatabaseObject* self) {
+    DatabaseManager* dbm = self->dbm;
+    self->dbm = nullptr;
+    Py_BEGIN_ALLOW_THREADS
+    delete dbm; // flushes in-memory databases
+    Py_END_ALLOW_THREADS
+    PyTypeObject* type = Py_TYPE(self);
+    type->tp_free(reinterpret_cast<PyObject*>(self));
+    Py_DECREF(type); // heap type
+}
+
+bool ensureOpen(DatabaseObject* self) {
+    if (self->dbm) return true;
+    PyErr_SetString(PyExc_RuntimeError, "database is not open");
+    return false;
+}
+
+PyObject* Database_add_students(DatabaseObject* self, PyObject* args, PyObject* kwargs) {
+    static const char* kwlist[] = {"rows", "chunk_rows", nullptr};
+    PyObject* rows;
+    Py_ssize_t chunkRows = 65536;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|n", const_cast<char**>(kwlist), &rows, &chunkRows)) {
+        return nullptr;
+    }
+    if (!ensureOpen(self)) return nullptr;
+    if (chunkRows <= 0) {
+        PyErr_SetString(PyExc_ValueError, "chunk_rows must be positive");
+        return nullptr;
+    }
+    PyObject* it = PyObject_GetIter(rows);
+    if (!it) return nullptr;
+    std::vector<Student> chunk;
+    chunk.reserve((size_t)chunkRows);
+    size_t added = 0;
+    bool ok = true;
+    auto flushChunk = [&] {
+        if (chunk.empty()) return true;
+        bool done = withoutGil([&] { added += self->dbm->addStudents(chunk); });
+        chunk.clear();
+        return done;
+    };
+    PyObject* item;
+    while (ok && (item = PyIter_Next(it))) {
+        Student s;
+        ok = toStudent(item, s);
+        Py_DECREF(item);
+        if (!ok) break;
+        chunk.push_back(std::move(s));
+        if ((Py_ssize_t)chunk.size() == chunkRows) ok = flushChunk();
+    }
+    Py_DECREF(it);
+    if (ok && PyErr_Occurred()) ok = false; // iterator raised
+    if (ok) ok = flushChunk();
+    if (!ok) return nullptr;
+    return PyLong_FromSize_t(added);
+}
+
+PyObject* Database_scan_batches(DatabaseObject* self, PyObject* args, PyObject* kwargs) {
+    static const char* kwlist[] = {"fn", "batch_rows", nullptr};
+    PyObject* fn;
+    Py_ssize_t batchRows = 65536;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|n", const_cast<char**>(kwlist), &fn, &batchRows)) {
+        return nullptr;
+    }
+    if (!ensureOpen(self)) return nullptr;
+    if (!PyCallable_Check(fn) || batchRows <= 0) {
+        PyErr_SetString(PyExc_ValueError, "scan_batches(fn, batch_rows): fn must be callable, batch_rows > 0");
+        return nullptr;
+    }
+    ColumnBatch batch;
+    size_t rows = 0;
+    std::string error;
+    bool pyError = false;
+    // The GIL is taken back only to hand a full batch to fn.
+    auto deliver = [&] {
+        PyObject* d = batch.toDict();
+        PyObject* r = d ? PyObject_CallOneArg(fn, d) : nullptr;
+        Py_XDECREF(d);
+        Py_XDECREF(r);
+        batch.clear();
+        return r != nullptr;
+    };
+    PyThreadState* ts = PyEval_SaveThread();
+    try {
+        rows = self->dbm->forEachStudent([&](const Student& s) {
+            batch.add(s);
+            if ((Py_ssize_t)batch.size() < batchRows) return;
+            PyEval_RestoreThread(ts);
+            bool ok = deliver();
+            ts = PyEval_SaveThread();
+            if (!ok) throw PythonError();
+        });
+    } catch (const PythonError&) {
+        pyError = true;
+    } catch (const std::exception& e) {
+        error = e.what();
+    }
+    PyEval_RestoreThread(ts);
+    if (pyError) return nullptr;
+    if (!error.empty()) {
+        PyErr_SetString(PyExc_RuntimeError, error.c_str());
+        return nullptr;
+    }
+    if (batch.size() > 0 && !deliver()) return nullptr;
+    return PyLong_FromSize_t(rows);
+}
+
+PyObject* Database_scan(DatabaseObject* self, PyObject*) {
+    if (!ensureOpen(self)) return nullptr;
+    ColumnBatch batch;
+    if (!withoutGil([&] { self->dbm->forEachStudent([&](const Student& s) { batch.add(s); }); })) {
+        return nullptr;
+    }
+    return batch.toDict();
+}
+
+PyObject* Database_count(DatabaseObject* self, PyObject*) {
+    if (!ensureOpen(self)) return nullptr;
+    long long n = 0;
+    if (!withoutGil([&] { n = self->dbm->countStudents(); })) return nullptr;
+    return PyLong_FromLongLong(n);
+}
+
+PyObject* Database_aggregate(DatabaseObject* self, PyObject*) {
+    if (!ensureOpen(self)) return nullptr;
+    StudentStats st;
+    if (!withoutGil([&] { st = self->dbm->aggregate(); })) return nullptr;
+    PyObject* grades = PyDict_New();
+    if (!grades) return nullptr;
+    for (const auto& g : st.grades) {
+        PyObject* v = PyLong_FromSize_t(g.second);
+        if (!v || PyDict_SetItemString(grades, g.first.c_str(), v) != 0) {
+            Py_XDECREF(v);
+            Py_DECREF(grades);
+            return nullptr;
+        }
+        Py_DECREF(v);
+    }
+    PyObject* mean = st.count ? PyFloat_FromDouble((double)st.ageSum / st.count) : (Py_INCREF(Py_None), Py_None);
+    return Py_BuildValue("{s:n,s:N,s:i,s:i,s:N}", "count", (Py_ssize_t)st.count, "mean_age", mean,
+                         "min_age", st.minAge, "max_age", st.maxAge, "grades", grades);
+}
+
+PyObject* Database_flush(DatabaseObject* self, PyObject*) {
+    if (!ensureOpen(self)) return nullptr;
+    if (!withoutGil([&] { self->dbm->flush(); })) return nullptr;
+    Py_RETURN_NONE;
+}
+
+PyMethodDef Database_methods[] = {
+    {"add_students", (PyCFunction)(void (*)(void))Database_add_students, METH_VARARGS | METH_KEYWORDS,
+     "add_students(rows, chunk_rows=65536) -> int\n"
+     "Insert an iterable of (id, name, age, grade); each chunk is one transaction."},
+    {"scan_batches", (PyCFunction)(void (*)(void))Database_scan_batches, METH_VARARGS | METH_KEYWORDS,
+     "scan_batches(fn, batch_rows=65536) -> int\n"
+     "Stream the table in id order, calling fn with columnar batches; returns rows scanned."},
+    {"scan", (PyCFunction)Database_scan, METH_NOARGS, "scan() -> dict\nWhole table as one columnar batch."},
+    {"count", (PyCFunction)Database_count, METH_NOARGS, "count() -> int"},
+    {"aggregate", (PyCFunction)Database_aggregate, METH_NOARGS,
+     "aggregate() -> dict\ncount, mean/min/max age and the grade distribution."},
+    {"flush", (PyCFunction)Database_flush, METH_NOARGS, "flush()\nWrite an in-memory database back to its file."},
+    {nullptr, nullptr, 0, nullptr}};
+
+PyType_Slot Database_slots[] = {
+    {Py_tp_doc, (void*)"Database(path, key='mySecretKey', memory=False, history=True)"},
+    {Py_tp_new, (void*)PyType_GenericNew},
+    {Py_tp_init, (void*)Database_init},
+    {Py_tp_dealloc, (void*)Database_dealloc},
+    {Py_tp_methods, Database_methods},
+    {0, nullptr}};
+
+PyType_Spec Database_spec = {"sdms_native.Database", sizeof(DatabaseObject), 0, Py_TPFLAGS_DEFAULT,
+                             Database_slots};
+
+// strings(data, offsets) -> list[str] for a "name"/"grade" column.
+PyObject* native_strings(PyObject*, PyObject* args) {
+    Py_buffer data, offsets;
+    if (!PyArg_ParseTuple(args, "y*y*", &data, &offsets)) return nullptr;
+    PyObject* out = nullptr;
+    if (offsets.len % (Py_ssize_t)sizeof(int64_t) != 0 || offsets.len == 0) {
+        PyErr_SetString(PyExc_ValueError, "offsets must be a non-empty int64 buffer");
+    } else {
+        const int64_t* off = static_cast<const int64_t*>(offsets.buf);
+        Py_ssize_t n = offsets.len / (Py_ssize_t)sizeof(int64_t) - 1;
+        const char* base = static_cast<const char*>(data.buf);
+        out = PyList_New(n);
+        for (Py_ssize_t i = 0; out && i < n; ++i) {
+            if (off[i] < 0 || off[i] > off[i + 1] || off[i + 1] > (int64_t)data.len) {
+                PyErr_SetString(PyExc_ValueError, "offsets out of range");
+                Py_CLEAR(out);
+                break;
+            }
+            PyObject* s = PyUnicode_DecodeUTF8(base + off[i], (Py_ssize_t)(off[i + 1] - off[i]), "replace");
+            if (!s) {
+                Py_CLEAR(out);
+                break;
+            }
+            PyList_SET_ITEM(out, i, s);
+        }
+    }
+    PyBuffer_Release(&data);
+    PyBuffer_Release(&offsets);
+    return out;
+}
+
+PyMethodDef module_methods[] = {
+    {"strings", native_strings, METH_VARARGS, "strings(data, offsets) -> list[str]"},
+    {nullptr, nullptr, 0, nullptr}};
+
+PyModuleDef module = {PyModuleDef_HEAD_INIT, "sdms_native", "C++ student store fast paths", -1,
+                      module_methods, nullptr, nullptr, nullptr, nullptr};
+
+} // namespace
+
+PyMODINIT_FUNC PyInit_sdms_native() {
+    PyObject* m = PyModule_Create(&module);
+    if (!m) return nullptr;
+    PyObject* type = PyType_FromSpec(&Database_spec);
+    if (!type || PyModule_AddObject(m, "Database", type) < 0) {
+        Py_XDECREF(type);
+        Py_DECREF(m);
+        return nullptr;
+    }
+    return m;
+}
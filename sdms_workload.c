@@ -0,0 +1,108 @@
+/*
+ * Workload driver for the C file store (sdms.c), run by bench_compare.py
+ * --------------------------------------------------------------------
+ * Usage: ./sdms_workload_c N DATA_FILE
+ *
+ * Runs the shared workload (bulk add N, 5 full listings, N grade updates,
+ * N deletes, ids visited in the order (i * 7919) % N + 1) and prints one
+ * JSON line per phase: {"phase": ..., "ops": ..., "seconds": ...}, then
+ * {"peak_rss_kb": ...} from VmHWM (omitted where /proc is unavailable).
+ */
+#define SDMS_NO_MAIN
+#include "sdms.c"
+
+#include <time.h>
+
+static const char *grades[] = {"A+", "A", "B", "C", "D", "F"};
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *phase, long ops, double t0) {
+    printf("{\"phase\": \"%s\", \"ops\": %ld, \"seconds\": %.6f}\n", phase, ops, now_seconds() - t0);
+    fflush(stdout);
+}
+
+// Peak resident set of this process image. Unlike getrusage()'s ru_maxrss,
+// VmHWM restarts at exec, so it does not include the launcher's memory.
+static long peak_rss_kb(void) {
+    FILE *f = fopen("/proc/self/status", "r");
+    if (!f) return -1;
+    char line[256];
+    long kb = -1;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "VmHWM: %ld", &kb) == 1) break;
+    }
+    fclose(f);
+    return kb;
+}
+
+// Listings materialize every record, as the C++/Python list calls do.
+typedef struct {
+    Student *rows;
+    int n, cap;
+} StudentVec;
+
+static void collect(const Student *s, void *ctx) {
+    StudentVec *v = (StudentVec *)ctx;
+    if (v->n == v->cap) {
+        v->cap = v->cap ? v->cap * 2 : 64;
+        v->rows = realloc(v->rows, v->cap * sizeof(Student));
+        if (!v->rows) { perror("realloc"); exit(1); }
+    }
+    v->rows[v->n++] = *s;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s N DATA_FILE\n", argv[0]);
+        return 2;
+    }
+    long n = atol(argv[1]);
+    const char *path = argv[2];
+    if (n <= 0 || n % 7919 == 0) {
+        fprintf(stderr, "N must be positive and not a multiple of 7919\n");
+        return 2;
+    }
+    remove(path);
+
+    double t0 = now_seconds();
+    for (long i = 1; i <= n; ++i) {
+        Student s;
+        s.id = (int)i;
+        snprintf(s.name, sizeof(s.name), "Student %ld", i);
+        s.age = 18 + (int)(i % 10);
+        snprintf(s.grade, sizeof(s.grade), "%s", grades[i % 6]);
+        if (store_add(path, &s) != 0) { perror("add"); return 1; }
+    }
+    report("add", n, t0);
+
+    t0 = now_seconds();
+    long listed = 0;
+    for (int pass = 0; pass < 5; ++pass) {
+        StudentVec v = {NULL, 0, 0};
+        store_for_each(path, collect, &v);
+        listed += v.n;
+        free(v.rows);
+    }
+    report("list", listed, t0);
+
+    t0 = now_seconds();
+    for (long i = 1; i <= n; ++i) {
+        if (store_update_grade(path, (int)((i * 7919) % n + 1), "B") != 1) { fprintf(stderr, "update miss\n"); return 1; }
+    }
+    report("update", n, t0);
+
+    t0 = now_seconds();
+    for (long i = 1; i <= n; ++i) {
+        if (store_delete(path, (int)((i * 7919) % n + 1)) != 1) { fprintf(stderr, "delete miss\n"); return 1; }
+    }
+    report("delete", n, t0);
+    remove(path);
+    long kb = peak_rss_kb();
+    if (kb >= 0) printf("{\"peak_rss_kb\": %ld}\n", kb);
+    return 0;
+}
@@ -0,0 +1,73 @@
+/*
+ * Workload driver for the C++ store (sdms.cpp), run by bench_compare.py
+ * --------------------------------------------------------------------
+ * Usage: ./sdms_workload_cpp N DB_FILE
+ *
+ * Same workload and output as sdms_workload.c, against DatabaseManager with
+ * default options (file-backed SQLite, grade history on).
+ */
+#define SDMS_NO_MAIN
+#include "sdms.cpp"
+
+#include <cstdio>
+
+// VmHWM of this process image; see sdms_workload.c.
+static long peakRssKb() {
+    std::ifstream f("/proc/self/status");
+    std::string line;
+    while (std::getline(f, line)) {
+        if (line.compare(0, 6, "VmHWM:") == 0) return std::atol(line.c_str() + 6);
+    }
+    return -1;
+}
+
+static void report(const char* phase, long long ops, std::chrono::steady_clock::time_point t0) {
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    std::printf("{\"phase\": \"%s\", \"ops\": %lld, \"seconds\": %.6f}\n", phase, ops, secs);
+    std::fflush(stdout);
+}
+
+int main(int argc, char** argv) {
+    if (argc != 3) {
+        std::cerr << "Usage: " << argv[0] << " N DB_FILE\n";
+        return 2;
+    }
+    long long n = std::atoll(argv[1]);
+    std::string path = argv[2];
+    if (n <= 0 || n % 7919 == 0) {
+        std::cerr << "N must be positive and not a multiple of 7919\n";
+        return 2;
+    }
+    std::remove(path.c_str());
+    static const char* grades[] = {"A+", "A", "B", "C", "D", "F"};
+    typedef std::chrono::steady_clock Clock;
+    try {
+        DatabaseManager dbm(path, "benchKey");
+
+        auto t0 = Clock::now();
+        for (long long i = 1; i <= n; ++i) {
+            dbm.addStudent(Student{(int)i, "Student " + std::to_string(i), 18 + (int)(i % 10), grades[i % 6]});
+        }
+        report("add", n, t0);
+
+        t0 = Clock::now();
+        long long listed = 0;
+        for (int pass = 0; pass < 5; ++pass) listed += (long long)dbm.getAllStudents().size();
+        report("list", listed, t0);
+
+        t0 = Clock::now();
+        for (long long i = 1; i <= n; ++i) dbm.updateStudentGrade((int)((i * 7919) % n + 1), "B");
+        report("update", n, t0);
+
+        t0 = Clock::now();
+        for (long long i = 1; i <= n; ++i) dbm.deleteStudent((int)((i * 7919) % n + 1));
+        report("delete", n, t0);
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        return 1;
+    }
+    std::remove(path.c_str());
+    long kb = peakRssKb();
+    if (kb >= 0) std::printf("{\"peak_rss_kb\": %ld}\n", kb);
+    return 0;
+}
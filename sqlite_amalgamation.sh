@@ -0,0 +1,86 @@
+#!/bin/sh
+# Build sdms / sdms_bench with the SQLite amalgamation compiled in, instead
+# of linking the distribution's libsqlite3, and compare the two.
+#
+#   ./sqlite_amalgamation.sh build   DIR                 -> build-amalgamation/sdms, sdms_bench
+#   ./sqlite_amalgamation.sh compare DIR [bench args]    -> side-by-side sdms_bench table
+#
+# DIR holds sqlite3.c and sqlite3.h from a sqlite-amalgamation-*.zip
+# (https://www.sqlite.org/download.html); the tree does not vendor it.
+# `compare` runs sdms_bench against the system library with --save-baseline,
+# then against the amalgamation build with --baseline, so the table marks each
+# scenario faster / same / SLOWER (exit 3 if a CRUD scenario got slower).
+# Extra arguments go to both runs (default: --reps 5).
+set -e
+
+# Options for this program's access pattern. Not used here, so left out:
+# shared cache, extensions, deprecated APIs, JSON, declared column types.
+# Kept: the progress callback (query cancellation), the backup API
+# (--memory) and compile-option diagnostics (sqliteHasLookaside()).
+SQLITE_OPTS="
+  -DSQLITE_THREADSAFE=2
+  -DSQLITE_DEFAULT_MEMSTATUS=0
+  -DSQLITE_DEFAULT_WAL_SYNCHRONOUS=1
+  -DSQLITE_DQS=0
+  -DSQLITE_LIKE_DOESNT_MATCH_BLOBS
+  -DSQLITE_MAX_EXPR_DEPTH=0
+  -DSQLITE_USE_ALLOCA
+  -DSQLITE_OMIT_DEPRECATED
+  -DSQLITE_OMIT_SHARED_CACHE
+  -DSQLITE_OMIT_LOAD_EXTENSION
+  -DSQLITE_OMIT_DECLTYPE
+  -DSQLITE_OMIT_JSON
+"
+# SQLITE_DEFAULT_MEMSTATUS=0 only changes the default: sdms_bench turns
+# memory accounting back on at startup so its sqlite-used/peak columns are
+# comparable between the two builds. sdms does so only for --soft-heap-limit
+# and otherwise leaves its sqlite memory gauges out rather than report 0.
+# SQLITE_THREADSAFE=2 opens connections in multi-thread mode by default;
+# DatabaseManager shares its connection across threads and opens it with
+# SQLITE_OPEN_FULLMUTEX, so only the global mutexes go away.
+
+OUT=build-amalgamation
+CXXFLAGS="${CXXFLAGS:--O2}"
+
+usage() {
+    echo "usage: $0 build DIR | compare DIR [sdms_bench args]" >&2
+    exit 2
+}
+
+build() {
+    dir=$1
+    if [ ! -f "$dir/sqlite3.c" ] || [ ! -f "$dir/sqlite3.h" ]; then
+        echo "$dir must contain sqlite3.c and sqlite3.h (SQLite amalgamation)" >&2
+        exit 2
+    fi
+    mkdir -p "$OUT"
+    # shellcheck disable=SC2086
+    gcc -O2 $SQLITE_OPTS -c "$dir/sqlite3.c" -o "$OUT/sqlite3.o"
+    # -I puts the amalgamation's sqlite3.h ahead of /usr/include.
+    g++ $CXXFLAGS -I "$dir" sdms.cpp "$OUT/sqlite3.o" -o "$OUT/sdms" -lpthread -lm
+    g++ $CXXFLAGS -I "$dir" sdms_bench.cpp "$OUT/sqlite3.o" -o "$OUT/sdms_bench" -lpthread -lm
+    echo "built $OUT/sdms and $OUT/sdms_bench"
+}
+
+[ $# -ge 2 ] || usage
+cmd=$1
+dir=$2
+shift 2
+cd "$(dirname "$0")"
+case "$cmd" in
+    build)
+        build "$dir"
+        ;;
+    compare)
+        build "$dir"
+        g++ $CXXFLAGS sdms_bench.cpp -o "$OUT/sdms_bench_system" -lsqlite3 -lpthread
+        [ $# -gt 0 ] || set -- --reps 5
+        echo "== system libsqlite3"
+        "$OUT/sdms_bench_system" "$@" --save-baseline "$OUT/system.json"
+        echo "== amalgamation"
+        "$OUT/sdms_bench" "$@" --baseline "$OUT/system.json"
+        ;;
+    *)
+        usage
+        ;;
+esac